@@ -0,0 +1,101 @@
+"""
+
+Measures how long a MessageDirector takes to accept a reconnect storm, that
+is a large number of clients all connecting at once.
+
+Run it from a directory containing the built libotp module:
+
+    python scripts/bench_accept.py --connections 10000
+
+"""
+
+from __future__ import print_function
+
+import argparse
+import errno
+import socket
+import sys
+import time
+
+from panda3d.core import AsyncTaskManager
+
+from libotp import MessageDirector
+
+
+def raise_fd_limit(needed):
+    try:
+        import resource
+    except ImportError:
+        return
+
+    soft, hard = resource.getrlimit(resource.RLIMIT_NOFILE)
+    if soft >= needed:
+        return
+
+    target = needed if hard == resource.RLIM_INFINITY else min(needed, hard)
+    resource.setrlimit(resource.RLIMIT_NOFILE, (target, hard))
+    if target < needed:
+        print("Warning: only %d file descriptors available, %d needed" % (target, needed))
+
+
+def open_clients(address, port, count):
+    clients = []
+    for _ in range(count):
+        client = socket.socket(socket.AF_INET, socket.SOCK_STREAM)
+        client.setblocking(False)
+        result = client.connect_ex((address, port))
+        if result not in (0, errno.EINPROGRESS, errno.EWOULDBLOCK):
+            client.close()
+            raise RuntimeError("connect failed with errno %d" % result)
+
+        clients.append(client)
+
+    return clients
+
+
+def main():
+    parser = argparse.ArgumentParser(description="Time to fully connected for a reconnect storm")
+    parser.add_argument("--address", default="127.0.0.1")
+    parser.add_argument("--port", type=int, default=7199)
+    parser.add_argument("--connections", type=int, default=10000)
+    parser.add_argument("--threads", type=int, default=1)
+    parser.add_argument("--timeout", type=float, default=60.0)
+    args = parser.parse_args()
+
+    # each connection is a socket on both ends
+    raise_fd_limit(args.connections * 2 + 64)
+
+    director = MessageDirector(args.address, args.port, args.connections, args.threads)
+    task_mgr = AsyncTaskManager.get_global_ptr()
+    task_mgr.poll()
+
+    start = time.time()
+    clients = open_clients(args.address, args.port, args.connections)
+    connected = time.time()
+
+    frames = 0
+    while director.get_num_accepted() < args.connections:
+        if time.time() - start > args.timeout:
+            print("Timed out with %d of %d connections accepted" % (director.get_num_accepted(), args.connections))
+            break
+
+        task_mgr.poll()
+        frames += 1
+
+    elapsed = time.time() - start
+    print("connections:       %d" % args.connections)
+    print("accepted:          %d" % director.get_num_accepted())
+    print("connect calls:     %.3f s" % (connected - start))
+    print("fully connected:   %.3f s" % elapsed)
+    print("frames:            %d" % frames)
+    print("accept high water: %d" % director.get_accept_high_water())
+    print("io_uring:          %s" % director.is_io_uring())
+
+    for client in clients:
+        client.close()
+
+    return 0 if director.get_num_accepted() >= args.connections else 1
+
+
+if __name__ == "__main__":
+    sys.exit(main())
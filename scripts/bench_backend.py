@@ -0,0 +1,136 @@
+"""
+
+Compares the Panda networking backend against io_uring by pushing messages
+between two NetworkConnectors through a MessageDirector on each backend,
+reporting throughput alongside how many submissions the io_uring backend
+needed for the messages it moved.
+
+Run it from a directory containing the built libotp module:
+
+    python scripts/bench_backend.py --messages 200000
+
+"""
+
+from __future__ import print_function
+
+import argparse
+import sys
+import time
+
+from panda3d.core import AsyncTaskManager, Datagram
+
+from libotp import MessageDirector, NetworkConnector
+
+
+# mirrors the backend defines in network.h
+NETWORK_BACKEND_PANDA = 1
+NETWORK_BACKEND_IO_URING = 2
+
+CONTROL_MESSAGE = 1
+CONTROL_SET_CHANNEL = 2002
+
+SENDER_CHANNEL = 4000
+RECEIVER_CHANNEL = 4001
+MESSAGE_TYPE = 2100
+
+
+def set_channel(connector, channel):
+    datagram = Datagram()
+    datagram.add_uint8(1)
+    datagram.add_uint64(CONTROL_MESSAGE)
+    datagram.add_uint16(CONTROL_SET_CHANNEL)
+    datagram.add_uint64(channel)
+    connector.send_datagram(datagram)
+
+
+def make_message(payload_size):
+    datagram = Datagram()
+    datagram.add_uint8(1)
+    datagram.add_uint64(RECEIVER_CHANNEL)
+    datagram.add_uint64(SENDER_CHANNEL)
+    datagram.add_uint16(MESSAGE_TYPE)
+    datagram.append_data(b"\0" * payload_size)
+    return datagram
+
+
+def report_io(name, network):
+    submits = network.get_num_io_submits()
+    messages = network.get_num_io_messages()
+    per_submit = messages / float(submits) if submits > 0 else 0.0
+    print("%-10s %-9s io submits: %d, io messages: %d, %.1f messages per submit" % (
+        "", name, submits, messages, per_submit))
+
+
+def run(name, backend, port, args):
+    director = MessageDirector(args.address, port, 100000, args.threads, backend)
+    task_mgr = AsyncTaskManager.get_global_ptr()
+    task_mgr.poll()
+
+    sender = NetworkConnector(args.address, port, 5000, 0, backend)
+    receiver = NetworkConnector(args.address, port, 5000, 0, backend)
+    if backend == NETWORK_BACKEND_IO_URING and not director.is_io_uring():
+        print("%-10s io_uring is not available, skipped" % name)
+        sender.disconnect()
+        receiver.disconnect()
+        return 0.0
+
+    set_channel(sender, SENDER_CHANNEL)
+    set_channel(receiver, RECEIVER_CHANNEL)
+    for _ in range(10):
+        task_mgr.poll()
+
+    message = make_message(args.payload)
+    base = receiver.get_num_received()
+    start = time.time()
+
+    sent = 0
+    while sent < args.messages:
+        for _ in range(min(args.batch, args.messages - sent)):
+            sender.send_datagram(message)
+            sent += 1
+
+        task_mgr.poll()
+
+    while receiver.get_num_received() - base < args.messages:
+        if time.time() - start > args.timeout:
+            print("Timed out with %d of %d messages received" % (receiver.get_num_received() - base, args.messages))
+            break
+
+        task_mgr.poll()
+
+    elapsed = time.time() - start
+    received = receiver.get_num_received() - base
+    rate = received / elapsed if elapsed > 0 else 0.0
+
+    print("%-10s %10d messages in %8.3f s, %12.0f messages/s" % (name, received, elapsed, rate))
+    if director.is_io_uring():
+        report_io("director", director)
+        report_io("sender", sender)
+        report_io("receiver", receiver)
+
+    sender.disconnect()
+    receiver.disconnect()
+    return rate
+
+
+def main():
+    parser = argparse.ArgumentParser(description="Panda networking against io_uring")
+    parser.add_argument("--address", default="127.0.0.1")
+    parser.add_argument("--port", type=int, default=7196)
+    parser.add_argument("--threads", type=int, default=1)
+    parser.add_argument("--messages", type=int, default=200000)
+    parser.add_argument("--payload", type=int, default=64)
+    parser.add_argument("--batch", type=int, default=1000)
+    parser.add_argument("--timeout", type=float, default=120.0)
+    args = parser.parse_args()
+
+    panda_rate = run("panda", NETWORK_BACKEND_PANDA, args.port, args)
+    io_uring_rate = run("io_uring", NETWORK_BACKEND_IO_URING, args.port + 1, args)
+    if panda_rate > 0 and io_uring_rate > 0:
+        print("%-10s %.2fx panda" % ("", io_uring_rate / panda_rate))
+
+    return 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())
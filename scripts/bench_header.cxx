@@ -0,0 +1,134 @@
+// Copyright (c) 2019, Caleb Marshall.
+//
+// This file is part of Toontown OTP.
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+//
+// You should have received a copy of the MIT License
+// along with Toontown OTP. If not, see <https://opensource.org/licenses/MIT>.
+
+
+// Compares MessageHeader::parse against the DatagramIterator sequence the
+// message director used to read headers with, on a single channel message
+// and on a message addressed to many channels.
+//
+// It isn't part of the module, build it against the same panda the module
+// is built against:
+//
+//     g++ -O2 -std=c++11 -Isource -I/usr/include/panda3d -o bench_header
+//         scripts/bench_header.cxx -lpanda -lpandaexpress -lp3dtool -lp3dtoolconfig
+//     ./bench_header 10000000
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "datagram.h"
+#include "datagramIterator.h"
+#include "trueClock.h"
+
+#include "messageheader.h"
+
+static Datagram make_message(uint8_t num_channels, size_t payload_size)
+{
+  Datagram datagram;
+  datagram.add_uint8(num_channels);
+  for (uint8_t n = 0; n < num_channels; n++)
+  {
+    datagram.add_uint64(5000 + n);
+  }
+
+  datagram.add_uint64(4000);
+  datagram.add_uint16(2100);
+  for (size_t n = 0; n < payload_size; n++)
+  {
+    datagram.add_uint8(0);
+  }
+
+  return datagram;
+}
+
+// the old sequence, every field read through the iterator's bounds checks
+static uint64_t read_iterator(const Datagram &datagram, uint64_t *channels)
+{
+  DatagramIterator iterator(datagram);
+  uint8_t num_channels = iterator.get_uint8();
+  for (uint8_t n = 0; n < num_channels; n++)
+  {
+    channels[n] = iterator.get_uint64();
+  }
+
+  uint64_t sender = iterator.get_uint64();
+  uint16_t message_type = iterator.get_uint16();
+  return channels[num_channels - 1] + sender + message_type + iterator.get_remaining_size();
+}
+
+static uint64_t read_header(const Datagram &datagram, uint64_t *channels)
+{
+  MessageHeader header;
+  if (!header.parse(datagram.get_data(), datagram.get_length()))
+  {
+    return 0;
+  }
+
+  header.get_channels(channels);
+  return channels[header.m_num_channels - 1] + header.m_sender + header.m_message_type + header.m_payload_length;
+}
+
+static double run(const char *name, uint64_t (*read)(const Datagram&, uint64_t*), const Datagram &datagram,
+                  size_t iterations)
+{
+  uint64_t channels[255];
+  TrueClock *clock = TrueClock::get_global_ptr();
+
+  // the checksum keeps the reads from being optimized away
+  uint64_t checksum = 0;
+  double start = clock->get_short_time();
+  for (size_t n = 0; n < iterations; n++)
+  {
+    checksum += read(datagram, channels);
+  }
+
+  double elapsed = clock->get_short_time() - start;
+  double rate = elapsed > 0 ? iterations / elapsed : 0.0;
+  printf("  %-10s %8.3f s, %12.0f headers/s, %6.1f ns/header (checksum %llu)\n", name, elapsed, rate,
+         elapsed * 1e9 / iterations, (unsigned long long)checksum);
+  return rate;
+}
+
+int main(int argc, char *argv[])
+{
+  size_t iterations = argc > 1 ? strtoul(argv[1], nullptr, 10) : 10000000;
+  const uint8_t channel_counts[] = {1, 4, 32, 255};
+
+  for (uint8_t num_channels : channel_counts)
+  {
+    Datagram datagram = make_message(num_channels, 64);
+    printf("%u channel%s, %zu byte message\n", num_channels, num_channels == 1 ? "" : "s",
+           datagram.get_length());
+
+    double iterator_rate = run("iterator", read_iterator, datagram, iterations);
+    double header_rate = run("header", read_header, datagram, iterations);
+    if (iterator_rate > 0)
+    {
+      printf("  %-10s %.2fx iterator\n", "", header_rate / iterator_rate);
+    }
+  }
+
+  return 0;
+}
@@ -0,0 +1,122 @@
+"""
+
+Compares routing through in-process LocalConnectors against NetworkConnectors
+talking to the same MessageDirector over loopback TCP.
+
+Run it from a directory containing the built libotp module:
+
+    python scripts/bench_local.py --messages 200000
+
+"""
+
+from __future__ import print_function
+
+import argparse
+import sys
+import time
+
+from panda3d.core import AsyncTaskManager, Datagram
+
+from libotp import MessageDirector, NetworkConnector, LocalConnector
+
+
+CONTROL_MESSAGE = 1
+CONTROL_SET_CHANNEL = 2002
+
+SENDER_CHANNEL = 4000
+RECEIVER_CHANNEL = 4001
+MESSAGE_TYPE = 2100
+
+
+def set_channel(connector, channel):
+    datagram = Datagram()
+    datagram.add_uint8(1)
+    datagram.add_uint64(CONTROL_MESSAGE)
+    datagram.add_uint16(CONTROL_SET_CHANNEL)
+    datagram.add_uint64(channel)
+    connector.send_datagram(datagram)
+
+
+def make_message(payload_size):
+    datagram = Datagram()
+    datagram.add_uint8(1)
+    datagram.add_uint64(RECEIVER_CHANNEL)
+    datagram.add_uint64(SENDER_CHANNEL)
+    datagram.add_uint16(MESSAGE_TYPE)
+    datagram.append_data(b"\0" * payload_size)
+    return datagram
+
+
+def run(task_mgr, sender, receiver, args):
+    set_channel(sender, SENDER_CHANNEL)
+    set_channel(receiver, RECEIVER_CHANNEL)
+    for _ in range(10):
+        task_mgr.poll()
+
+    message = make_message(args.payload)
+    base = receiver.get_num_received()
+    start = time.time()
+
+    sent = 0
+    while sent < args.messages:
+        for _ in range(min(args.batch, args.messages - sent)):
+            sender.send_datagram(message)
+            sent += 1
+
+        task_mgr.poll()
+
+    while receiver.get_num_received() - base < args.messages:
+        if time.time() - start > args.timeout:
+            print("Timed out with %d of %d messages received" % (receiver.get_num_received() - base, args.messages))
+            break
+
+        task_mgr.poll()
+
+    elapsed = time.time() - start
+    received = receiver.get_num_received() - base
+    return elapsed, received
+
+
+def report(name, elapsed, received):
+    rate = received / elapsed if elapsed > 0 else 0.0
+    print("%-10s %10d messages in %8.3f s, %12.0f messages/s" % (name, received, elapsed, rate))
+    return rate
+
+
+def main():
+    parser = argparse.ArgumentParser(description="In-process participants against loopback TCP")
+    parser.add_argument("--address", default="127.0.0.1")
+    parser.add_argument("--port", type=int, default=7198)
+    parser.add_argument("--messages", type=int, default=200000)
+    parser.add_argument("--payload", type=int, default=64)
+    parser.add_argument("--batch", type=int, default=1000)
+    parser.add_argument("--timeout", type=float, default=120.0)
+    args = parser.parse_args()
+
+    director = MessageDirector(args.address, args.port)
+    task_mgr = AsyncTaskManager.get_global_ptr()
+    task_mgr.poll()
+
+    sender = NetworkConnector(args.address, args.port)
+    receiver = NetworkConnector(args.address, args.port)
+    elapsed, received = run(task_mgr, sender, receiver, args)
+    network_rate = report("tcp", elapsed, received)
+    sender.disconnect()
+    receiver.disconnect()
+
+    for queued in (True, False):
+        sender = LocalConnector(director, queued)
+        receiver = LocalConnector(director, queued)
+        elapsed, received = run(task_mgr, sender, receiver, args)
+        rate = report("queued" if queued else "direct", elapsed, received)
+        if network_rate > 0:
+            print("%-10s %.1fx loopback tcp" % ("", rate / network_rate))
+
+        sender.disconnect()
+        receiver.disconnect()
+
+    return 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())
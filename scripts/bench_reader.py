@@ -0,0 +1,136 @@
+"""
+
+Compares the mutex protected reader queue against the lock-free reader rings
+by pushing messages from several NetworkConnectors through a threaded
+MessageDirector, once with otp-lock-free-reader off and once with it on.
+
+Run it from a directory containing the built libotp module:
+
+    python scripts/bench_reader.py --senders 4 --messages 200000
+
+"""
+
+from __future__ import print_function
+
+import argparse
+import sys
+import time
+
+from panda3d.core import AsyncTaskManager, Datagram, load_prc_file_data
+
+from libotp import MessageDirector, NetworkConnector
+
+
+CONTROL_MESSAGE = 1
+CONTROL_SET_CHANNEL = 2002
+
+SENDER_CHANNEL = 4000
+RECEIVER_CHANNEL = 5000
+MESSAGE_TYPE = 2100
+
+
+def set_channel(connector, channel):
+    datagram = Datagram()
+    datagram.add_uint8(1)
+    datagram.add_uint64(CONTROL_MESSAGE)
+    datagram.add_uint16(CONTROL_SET_CHANNEL)
+    datagram.add_uint64(channel)
+    connector.send_datagram(datagram)
+
+
+def make_message(sender, payload_size):
+    datagram = Datagram()
+    datagram.add_uint8(1)
+    datagram.add_uint64(RECEIVER_CHANNEL)
+    datagram.add_uint64(sender)
+    datagram.add_uint16(MESSAGE_TYPE)
+    datagram.append_data(b"\0" * payload_size)
+    return datagram
+
+
+def run(lock_free, port, args):
+    load_prc_file_data("", "otp-lock-free-reader %d" % int(lock_free))
+
+    director = MessageDirector(args.address, port, 100000, args.threads)
+    task_mgr = AsyncTaskManager.get_global_ptr()
+    task_mgr.poll()
+
+    receiver = NetworkConnector(args.address, port)
+    set_channel(receiver, RECEIVER_CHANNEL)
+
+    senders = []
+    messages = []
+    for n in range(args.senders):
+        sender = NetworkConnector(args.address, port)
+        set_channel(sender, SENDER_CHANNEL + n)
+        senders.append(sender)
+        messages.append(make_message(SENDER_CHANNEL + n, args.payload))
+
+    for _ in range(10):
+        task_mgr.poll()
+
+    total = args.messages * args.senders
+    base = receiver.get_num_received()
+    start = time.time()
+
+    sent = 0
+    while sent < args.messages:
+        count = min(args.batch, args.messages - sent)
+        for sender, message in zip(senders, messages):
+            for _ in range(count):
+                sender.send_datagram(message)
+
+        sent += count
+        task_mgr.poll()
+
+    while receiver.get_num_received() - base < total:
+        if time.time() - start > args.timeout:
+            print("Timed out with %d of %d messages received" % (receiver.get_num_received() - base, total))
+            break
+
+        task_mgr.poll()
+
+    elapsed = time.time() - start
+    received = receiver.get_num_received() - base
+    rate = received / elapsed if elapsed > 0 else 0.0
+
+    print("%-10s %10d messages in %8.3f s, %12.0f messages/s" % (
+        "lock-free" if lock_free else "mutex", received, elapsed, rate))
+    print("%-10s lock-free: %s, ring full: %d, cas retries: %d" % (
+        "", director.is_reader_lock_free(), director.get_num_reader_ring_full(),
+        director.get_num_reader_ring_retries()))
+
+    for sender in senders:
+        sender.disconnect()
+
+    receiver.disconnect()
+    return rate
+
+
+def main():
+    parser = argparse.ArgumentParser(description="Mutex reader queue against lock-free reader rings")
+    parser.add_argument("--address", default="127.0.0.1")
+    parser.add_argument("--port", type=int, default=7197)
+    parser.add_argument("--senders", type=int, default=4)
+    parser.add_argument("--threads", type=int, default=4)
+    parser.add_argument("--messages", type=int, default=200000)
+    parser.add_argument("--payload", type=int, default=64)
+    parser.add_argument("--batch", type=int, default=1000)
+    parser.add_argument("--timeout", type=float, default=120.0)
+    args = parser.parse_args()
+
+    # the reader only hands off between threads when it has some
+    if args.threads < 1:
+        print("The lock-free reader needs at least one reader thread")
+        return 1
+
+    mutex_rate = run(False, args.port, args)
+    lock_free_rate = run(True, args.port + 1, args)
+    if mutex_rate > 0:
+        print("%-10s %.2fx mutex queue" % ("", lock_free_rate / mutex_rate))
+
+    return 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())
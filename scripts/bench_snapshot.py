@@ -0,0 +1,108 @@
+"""
+
+Measures how long a MessageDirector takes to restore its routing table from
+a snapshot, writing snapshots of increasing size and loading each one into
+a fresh MessageDirector.
+
+Run it from a directory containing the built libotp module:
+
+    python scripts/bench_snapshot.py --max-channels 4000000
+
+"""
+
+from __future__ import print_function
+
+import argparse
+import os
+import shutil
+import struct
+import sys
+import tempfile
+
+from panda3d.core import AsyncTaskManager, load_prc_file_data
+
+from libotp import MessageDirector
+
+
+# mirrors the snapshot layout in messagedirector.cxx
+SNAPSHOT_MAGIC = 0x5350544f
+SNAPSHOT_VERSION = 1
+
+FIRST_CHANNEL = 100000000
+FIRST_OWNER = 4000000000
+
+
+def write_snapshot(path, num_channels, channels_per_owner, post_remove_size):
+    num_owners = (num_channels + channels_per_owner - 1) // channels_per_owner
+    num_post_removes = num_owners if post_remove_size > 0 else 0
+    post_remove = b"\0" * post_remove_size
+
+    with open(path, "wb") as snapshot:
+        snapshot.write(struct.pack("<IIII", SNAPSHOT_MAGIC, SNAPSHOT_VERSION, num_channels, num_post_removes))
+
+        pair = struct.Struct("<QQ")
+        chunk = []
+        for n in range(num_channels):
+            chunk.append(pair.pack(FIRST_CHANNEL + n, FIRST_OWNER + n // channels_per_owner))
+            if len(chunk) >= 65536:
+                snapshot.write(b"".join(chunk))
+                chunk = []
+
+        snapshot.write(b"".join(chunk))
+
+        for n in range(num_post_removes):
+            snapshot.write(struct.pack("<QI", FIRST_OWNER + n, post_remove_size))
+            snapshot.write(post_remove)
+
+    return num_owners, os.path.getsize(path)
+
+
+def main():
+    parser = argparse.ArgumentParser(description="Snapshot load time against channel count")
+    parser.add_argument("--address", default="127.0.0.1")
+    parser.add_argument("--port", type=int, default=7195)
+    parser.add_argument("--min-channels", type=int, default=1000)
+    parser.add_argument("--max-channels", type=int, default=4000000)
+    parser.add_argument("--channels-per-owner", type=int, default=4)
+    parser.add_argument("--post-remove-size", type=int, default=32)
+    args = parser.parse_args()
+
+    directory = tempfile.mkdtemp(prefix="otp-snapshot-")
+    path = os.path.join(directory, "routing.snapshot")
+    load_prc_file_data("", "otp-snapshot-path %s" % path)
+    task_mgr = AsyncTaskManager.get_global_ptr()
+
+    print("%12s %12s %12s %10s %14s" % ("channels", "owners", "bytes", "load s", "channels/s"))
+
+    port = args.port
+    num_channels = args.min_channels
+    failed = False
+    try:
+        while num_channels <= args.max_channels:
+            num_owners, size = write_snapshot(path, num_channels, args.channels_per_owner, args.post_remove_size)
+
+            director = MessageDirector(args.address, port)
+            task_mgr.poll()
+
+            interface = director.get_interface()
+            restored = interface.get_num_restored_channels()
+            elapsed = interface.get_snapshot_load_time()
+            rate = restored / elapsed if elapsed > 0 else 0.0
+            print("%12d %12d %12d %10.4f %14.0f" % (num_channels, num_owners, size, elapsed, rate))
+
+            if restored != num_channels:
+                print("Restored %d of %d channels" % (restored, num_channels))
+                failed = True
+                break
+
+            del director
+            port += 1
+            num_channels *= 4
+    finally:
+        shutil.rmtree(directory, ignore_errors=True)
+
+    return 1 if failed else 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())
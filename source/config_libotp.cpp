@@ -28,10 +28,280 @@
 
 #include "network.h"
 #include "messagedirector.h"
+#include "localconnector.h"
+#include "responsefuture.h"
 
 Configure(config_libotp);
 NotifyCategoryDef(libotp , "");
 
+ConfigVariableInt otp_writer_queue_limit
+("otp-writer-queue-limit", 64,
+ PRC_DESC("The number of datagrams a threaded connection writer may have queued "
+          "before bulk traffic is held back in the outbound priority lanes, "
+          "so that control traffic never waits behind more than this."));
+
+ConfigVariableBool otp_link_compression
+("otp-link-compression", false,
+ PRC_DESC("Set this true to compress large datagrams on our links. Connectors "
+          "request it when they connect, and acceptors only grant it when "
+          "this is also set on their end."));
+
+ConfigVariableInt otp_link_compression_threshold
+("otp-link-compression-threshold", 1024,
+ PRC_DESC("Datagrams smaller than this many bytes are never compressed."));
+
+ConfigVariableInt otp_link_compression_level
+("otp-link-compression-level", 1,
+ PRC_DESC("The zlib compression level used on links, 1 is the fastest."));
+
+ConfigVariableDouble otp_link_compression_ratio
+("otp-link-compression-ratio", 0.9,
+ PRC_DESC("A compressed datagram larger than this fraction of its original "
+          "size is sent uncompressed instead. A run of these bypasses "
+          "compression on the link for a while."));
+
+ConfigVariableInt otp_link_max_decompressed_size
+("otp-link-max-decompressed-size", 16777216,
+ PRC_DESC("The most bytes a single compressed frame may inflate to. Frames "
+          "that would inflate past this are rejected, so a peer can't send "
+          "a small frame that expands into gigabytes."));
+
+ConfigVariableBool otp_link_tracing
+("otp-link-tracing", false,
+ PRC_DESC("Set this true to let links carry latency traces. Both ends of a "
+          "link have to turn this on for traced messages to go over it."));
+
+ConfigVariableInt otp_trace_sample_rate
+("otp-trace-sample-rate", 1000,
+ PRC_DESC("One in every this many messages a connector sends is traced, on "
+          "links that carry traces."));
+
+ConfigVariableBool otp_link_fragmentation
+("otp-link-fragmentation", false,
+ PRC_DESC("Set this true to let links split large messages into fragments "
+          "that are interleaved with the rest of the traffic. Both ends of "
+          "a link have to turn this on."));
+
+ConfigVariableInt otp_fragment_size
+("otp-fragment-size", 16384,
+ PRC_DESC("Messages larger than this many bytes are fragmented on links that "
+          "support it, and no fragment carries more than this."));
+
+ConfigVariableInt otp_fragment_burst
+("otp-fragment-burst", 4,
+ PRC_DESC("How many fragments each connection may send per frame before the "
+          "rest of the traffic gets another turn."));
+
+ConfigVariableInt otp_fragment_max_size
+("otp-fragment-max-size", 67108864,
+ PRC_DESC("The largest fragmented message, in bytes, a link will reassemble. "
+          "Anything larger is read and thrown away, which also bounds how "
+          "much memory reassembly takes per connection."));
+
+ConfigVariableInt otp_participant_max_channels
+("otp-participant-max-channels", 0,
+ PRC_DESC("The most channels a single participant may register, further "
+          "registrations are rejected. Zero means unlimited."));
+
+ConfigVariableInt otp_participant_max_post_remove_size
+("otp-participant-max-post-remove-size", 0,
+ PRC_DESC("The most bytes of post removes a single participant may have "
+          "registered, further post removes are rejected. Zero means "
+          "unlimited."));
+
+ConfigVariableInt otp_participant_max_memory
+("otp-participant-max-memory", 0,
+ PRC_DESC("The most bytes the message director will hold for a single "
+          "participant, counting its channels, its post removes and "
+          "anything buffered for it. A participant over this is "
+          "disconnected. Zero means unlimited."));
+
+ConfigVariableBool otp_udp_side_channel
+("otp-udp-side-channel", false,
+ PRC_DESC("Set this true to open a UDP side channel next to each TCP link, "
+          "unreliable message types go over it once it's up. Not available "
+          "on the io_uring backend."));
+
+ConfigVariableInt otp_udp_port
+("otp-udp-port", 0,
+ PRC_DESC("The port the message director listens for UDP on, zero means "
+          "the same port as TCP."));
+
+ConfigVariableInt otp_udp_max_size
+("otp-udp-max-size", 1200,
+ PRC_DESC("The largest UDP frame we'll send, in bytes. Unreliable messages "
+          "that don't fit go over TCP instead."));
+
+ConfigVariableInt otp_udp_max_sequences
+("otp-udp-max-sequences", 65536,
+ PRC_DESC("How many channel and message type pairs each peer's inbound UDP "
+          "sequence table remembers. The least recently updated are forgotten "
+          "first. Set to 0 for no limit."));
+
+ConfigVariableDouble otp_udp_hello_interval
+("otp-udp-hello-interval", 0.5,
+ PRC_DESC("How often, in seconds, a connector repeats its UDP hello until "
+          "the message director answers it."));
+
+ConfigVariableDouble otp_udp_loss_rate
+("otp-udp-loss-rate", 0.0,
+ PRC_DESC("The fraction of outgoing UDP frames to drop on purpose, for "
+          "testing how the cluster copes with packet loss."));
+
+ConfigVariableString otp_unreliable_message_types
+("otp-unreliable-message-types", "",
+ PRC_DESC("A space separated list of message types that are superseded "
+          "quickly, like position updates. They're sent over the UDP side "
+          "channel where the newest update per channel and type wins."));
+
+ConfigVariableString otp_conflate_message_types
+("otp-conflate-message-types", "",
+ PRC_DESC("A space separated list of message types whose queued updates are "
+          "conflated while a participant is backlogged, a newer update "
+          "replacing the older one in line. Each entry is a message type, "
+          "optionally followed by :offset:size of a key in the payload, up "
+          "to 8 bytes, e.g. a doId and field id together. Only updates from "
+          "the same sender with the same key replace each other."));
+
+ConfigVariableDouble otp_request_timeout
+("otp-request-timeout", 10.0,
+ PRC_DESC("How long, in seconds, a request sent with send_request waits for "
+          "its response before its future is cancelled, unless the request "
+          "gives its own timeout."));
+
+ConfigVariableInt otp_request_max_in_flight
+("otp-request-max-in-flight", 4096,
+ PRC_DESC("The most requests a connector may have waiting on a response at "
+          "once, at most 65536. Requests past this are cancelled right away."));
+
+ConfigVariableInt otp_reader_batch_size
+("otp-reader-batch-size", 1024,
+ PRC_DESC("The most datagrams an acceptor takes off its reader each frame."));
+
+ConfigVariableBool otp_lock_free_reader
+("otp-lock-free-reader", false,
+ PRC_DESC("Set this true to hand datagrams from the reader threads to the "
+          "polling thread through lock-free ring buffers instead of a "
+          "mutex protected queue."));
+
+ConfigVariableInt otp_reader_ring_size
+("otp-reader-ring-size", 65536,
+ PRC_DESC("The number of datagrams each lock-free reader ring holds. Reader "
+          "threads wait for room when a ring fills up."));
+
+ConfigVariableBool otp_io_uring
+("otp-io-uring", false,
+ PRC_DESC("Set this true to run connectors and acceptors on io_uring instead "
+          "of Panda's connection reader and writer. Only available on Linux "
+          "builds with liburing, anything else falls back to the default "
+          "backend."));
+
+ConfigVariableInt otp_io_uring_entries
+("otp-io-uring-entries", 4096,
+ PRC_DESC("The size of the io_uring submission queue."));
+
+ConfigVariableInt otp_io_uring_buffers
+("otp-io-uring-buffers", 4096,
+ PRC_DESC("The number of receive buffers registered with io_uring, rounded "
+          "up to a power of two. Every connection receives into this one "
+          "shared pool."));
+
+ConfigVariableInt otp_io_uring_buffer_size
+("otp-io-uring-buffer-size", 16384,
+ PRC_DESC("The size in bytes of each io_uring receive buffer."));
+
+ConfigVariableInt otp_io_uring_max_outbound
+("otp-io-uring-max-outbound", 16777216,
+ PRC_DESC("The most bytes coalesced for a single io_uring connection while "
+          "waiting for its last send to finish. Frames past this are refused "
+          "just like a full writer queue."));
+
+ConfigVariableInt otp_accept_batch_size
+("otp-accept-batch-size", 4096,
+ PRC_DESC("The most connections an acceptor accepts in a single frame."));
+
+ConfigVariableInt otp_handler_pool_size
+("otp-handler-pool-size", 1024,
+ PRC_DESC("How many participants worth of memory the message director puts "
+          "on its free list at startup, ready for a reconnect storm."));
+
+ConfigVariableDouble otp_ingress_message_rate
+("otp-ingress-message-rate", 0.0,
+ PRC_DESC("The number of messages per second each handler may send us before "
+          "otp-ingress-action kicks in, or 0 for no limit."));
+
+ConfigVariableDouble otp_ingress_byte_rate
+("otp-ingress-byte-rate", 0.0,
+ PRC_DESC("The number of bytes per second each handler may send us before "
+          "otp-ingress-action kicks in, or 0 for no limit."));
+
+ConfigVariableDouble otp_ingress_burst
+("otp-ingress-burst", 1.0,
+ PRC_DESC("How many seconds worth of the ingress rates a handler may burst."));
+
+ConfigVariableString otp_ingress_action
+("otp-ingress-action", "defer",
+ PRC_DESC("What to do with traffic over the ingress limits: defer, drop or "
+          "disconnect. Control messages are never held back."));
+
+ConfigVariableInt otp_ingress_max_deferred
+("otp-ingress-max-deferred", 65536,
+ PRC_DESC("The most datagrams we defer for a single handler, anything past "
+          "this is dropped."));
+
+ConfigVariableInt otp_ingress_quantum
+("otp-ingress-quantum", 64,
+ PRC_DESC("The most deferred datagrams serviced per handler per frame, "
+          "handlers are serviced round robin."));
+
+ConfigVariableString otp_snapshot_path
+("otp-snapshot-path", "",
+ PRC_DESC("Where the message director keeps a snapshot of its routing table "
+          "and post removes, so it can come back up warm after a restart. "
+          "Leave this empty to disable snapshots."));
+
+ConfigVariableDouble otp_snapshot_interval
+("otp-snapshot-interval", 5.0,
+ PRC_DESC("How often, in seconds, the routing snapshot is rewritten when "
+          "it has changed."));
+
+ConfigVariableDouble otp_snapshot_grace
+("otp-snapshot-grace", 60.0,
+ PRC_DESC("How long, in seconds, restored channels wait for their participant "
+          "to reconnect and claim them. Post removes of participants that "
+          "never come back are sent once this runs out."));
+
+ConfigVariableInt otp_snapshot_batch_size
+("otp-snapshot-batch-size", 64,
+ PRC_DESC("How many hash buckets of routing state are copied into a snapshot "
+          "per frame. The copy is written to disk on a background thread."));
+
+ConfigVariableBool otp_route_profile
+("otp-route-profile", true,
+ PRC_DESC("Set this false to stop the message director from tracking the "
+          "heaviest channels, senders and message types it routes."));
+
+ConfigVariableInt otp_route_profile_width
+("otp-route-profile-width", 4096,
+ PRC_DESC("The number of counters in each row of the route profiler's "
+          "count-min sketches, rounded up to a power of two. Wider sketches "
+          "overcount less."));
+
+ConfigVariableInt otp_route_profile_top
+("otp-route-profile-top", 32,
+ PRC_DESC("How many of the heaviest keys the route profiler keeps for each "
+          "ranking."));
+
+ConfigVariableDouble otp_route_profile_decay
+("otp-route-profile-decay", 60.0,
+ PRC_DESC("How often, in seconds, the route profiler halves its counts so "
+          "its rankings follow the current load. Zero keeps counting "
+          "forever."));
+
+ConfigVariableBool otp_route_profile_signal
+("otp-route-profile-signal", true,
+ PRC_DESC("Set this true to dump the route profile to the log on SIGUSR1."));
+
 ConfigureFn(config_libotp)
 {
   init_libotp();
@@ -46,12 +316,15 @@ void init_libotp()
   }
 
   NetworkConnector::init_type();
+  ResponseDatagram::init_type();
+  ResponseFuture::init_type();
   NetworkHandler::init_type();
   NetworkAcceptor::init_type();
 
   Participant::init_type();
   MessageDirector::init_type();
   ParticipantInterface::init_type();
+  LocalConnector::init_type();
 
   initialized = true;
 }
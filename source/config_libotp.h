@@ -27,7 +27,62 @@
 
 #include "pandabase.h"
 #include "notifyCategoryProxy.h"
+#include "configVariableBool.h"
+#include "configVariableInt.h"
+#include "configVariableDouble.h"
+#include "configVariableString.h"
 
 NotifyCategoryDecl(libotp, EXPORT_CLASS, EXPORT_TEMPL);
 
+extern ConfigVariableInt otp_writer_queue_limit;
+extern ConfigVariableBool otp_link_compression;
+extern ConfigVariableInt otp_link_compression_threshold;
+extern ConfigVariableInt otp_link_compression_level;
+extern ConfigVariableDouble otp_link_compression_ratio;
+extern ConfigVariableInt otp_link_max_decompressed_size;
+extern ConfigVariableBool otp_link_tracing;
+extern ConfigVariableInt otp_trace_sample_rate;
+extern ConfigVariableBool otp_link_fragmentation;
+extern ConfigVariableInt otp_fragment_size;
+extern ConfigVariableInt otp_fragment_burst;
+extern ConfigVariableInt otp_fragment_max_size;
+extern ConfigVariableInt otp_participant_max_channels;
+extern ConfigVariableInt otp_participant_max_post_remove_size;
+extern ConfigVariableInt otp_participant_max_memory;
+extern ConfigVariableBool otp_udp_side_channel;
+extern ConfigVariableInt otp_udp_port;
+extern ConfigVariableInt otp_udp_max_size;
+extern ConfigVariableInt otp_udp_max_sequences;
+extern ConfigVariableDouble otp_udp_hello_interval;
+extern ConfigVariableDouble otp_udp_loss_rate;
+extern ConfigVariableString otp_unreliable_message_types;
+extern ConfigVariableString otp_conflate_message_types;
+extern ConfigVariableDouble otp_request_timeout;
+extern ConfigVariableInt otp_request_max_in_flight;
+extern ConfigVariableInt otp_reader_batch_size;
+extern ConfigVariableBool otp_lock_free_reader;
+extern ConfigVariableInt otp_reader_ring_size;
+extern ConfigVariableBool otp_io_uring;
+extern ConfigVariableInt otp_io_uring_entries;
+extern ConfigVariableInt otp_io_uring_buffers;
+extern ConfigVariableInt otp_io_uring_buffer_size;
+extern ConfigVariableInt otp_io_uring_max_outbound;
+extern ConfigVariableInt otp_accept_batch_size;
+extern ConfigVariableInt otp_handler_pool_size;
+extern ConfigVariableDouble otp_ingress_message_rate;
+extern ConfigVariableDouble otp_ingress_byte_rate;
+extern ConfigVariableDouble otp_ingress_burst;
+extern ConfigVariableString otp_ingress_action;
+extern ConfigVariableInt otp_ingress_max_deferred;
+extern ConfigVariableInt otp_ingress_quantum;
+extern ConfigVariableString otp_snapshot_path;
+extern ConfigVariableDouble otp_snapshot_interval;
+extern ConfigVariableDouble otp_snapshot_grace;
+extern ConfigVariableInt otp_snapshot_batch_size;
+extern ConfigVariableBool otp_route_profile;
+extern ConfigVariableInt otp_route_profile_width;
+extern ConfigVariableInt otp_route_profile_top;
+extern ConfigVariableDouble otp_route_profile_decay;
+extern ConfigVariableBool otp_route_profile_signal;
+
 extern void init_libotp();
@@ -0,0 +1,661 @@
+// Copyright (c) 2019, Caleb Marshall.
+//
+// This file is part of Toontown OTP.
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+//
+// You should have received a copy of the MIT License
+// along with Toontown OTP. If not, see <https://opensource.org/licenses/MIT>.
+
+#include "iouring.h"
+#include "config_libotp.h"
+
+#ifdef HAVE_IO_URING
+
+#include <errno.h>
+#include <stdio.h>
+#include <sys/socket.h>
+#include <sys/utsname.h>
+
+#include <algorithm>
+
+// The operation a completion belongs to is kept in the low bits of its user
+// data, the rest is the IoUringConnection it was submitted for.
+#define IO_URING_OP_ACCEPT  0
+#define IO_URING_OP_RECV    1
+#define IO_URING_OP_SEND    2
+#define IO_URING_OP_CANCEL  3
+#define IO_URING_OP_MASK    3
+
+#define IO_URING_BUFFER_GROUP  1
+#define IO_URING_MAX_BUFFERS   32768
+#define IO_URING_CQE_BATCH     256
+
+class IoUringConnection
+{
+public:
+  PT(Connection) m_connection;
+  int m_fd = -1;
+
+  // bytes received that don't make up a whole frame yet
+  string m_inbound;
+
+  // frames queued this frame, and the ones the kernel is working on
+  string m_outbound;
+  size_t m_outbound_frames = 0;
+  string m_sending;
+  size_t m_sending_frames = 0;
+  size_t m_sent = 0;
+
+  bool m_recv_armed = false;
+  bool m_send_armed = false;
+  bool m_flushing = false;
+  bool m_rearming = false;
+  bool m_lost = false;
+  bool m_closed = false;
+};
+
+static inline uint64_t get_user_data(IoUringConnection *connection, uint64_t op)
+{
+  return (uint64_t)(uintptr_t)connection | op;
+}
+
+IoUringBackend::IoUringBackend(int tcp_header_size)
+  : m_tcp_header_size(tcp_header_size)
+{
+  // multishot receives with provided buffers landed in 6.0, don't bother
+  // with anything older than that
+  struct utsname name;
+  int major = 0, minor = 0;
+  if (uname(&name) != 0 || sscanf(name.release, "%d.%d", &major, &minor) != 2 || major < 6)
+  {
+    libotp_cat.warning() << "io_uring requires Linux 6.0 or newer!" << endl;
+    return;
+  }
+
+  int ret = io_uring_queue_init(otp_io_uring_entries, &m_ring, 0);
+  if (ret < 0)
+  {
+    libotp_cat.warning() << "Failed to setup io_uring, errno " << -ret << "!" << endl;
+    return;
+  }
+
+  // the buffer ring has to be a power of two in size
+  m_num_buffers = 1;
+  while (m_num_buffers < (size_t)otp_io_uring_buffers && m_num_buffers < IO_URING_MAX_BUFFERS)
+  {
+    m_num_buffers <<= 1;
+  }
+
+  m_buffer_size = otp_io_uring_buffer_size;
+  m_max_outbound = otp_io_uring_max_outbound;
+  m_buf_ring = io_uring_setup_buf_ring(&m_ring, m_num_buffers, IO_URING_BUFFER_GROUP, 0, &ret);
+  if (m_buf_ring == nullptr)
+  {
+    libotp_cat.warning() << "Failed to register the io_uring buffer ring, errno " << -ret << "!" << endl;
+    io_uring_queue_exit(&m_ring);
+    return;
+  }
+
+  m_buffers = new unsigned char[m_num_buffers * m_buffer_size];
+
+  int mask = io_uring_buf_ring_mask(m_num_buffers);
+  for (size_t i = 0; i < m_num_buffers; i++)
+  {
+    io_uring_buf_ring_add(m_buf_ring, m_buffers + i * m_buffer_size, m_buffer_size, i, mask, i);
+  }
+
+  io_uring_buf_ring_advance(m_buf_ring, m_num_buffers);
+  m_valid = true;
+}
+
+IoUringBackend::~IoUringBackend()
+{
+  if (!m_valid)
+  {
+    return;
+  }
+
+  // tearing down the ring cancels everything still in flight
+  io_uring_free_buf_ring(&m_ring, m_buf_ring, m_num_buffers, IO_URING_BUFFER_GROUP);
+  io_uring_queue_exit(&m_ring);
+
+  unordered_map<Connection*, IoUringConnection*>::iterator it = m_connections.begin();
+  for (; it != m_connections.end(); ++it)
+  {
+    delete it->second;
+  }
+
+  for (IoUringConnection *connection : m_closing)
+  {
+    delete connection;
+  }
+
+  delete[] m_buffers;
+}
+
+bool IoUringBackend::is_valid()
+{
+  return m_valid;
+}
+
+struct io_uring_sqe* IoUringBackend::get_sqe()
+{
+  struct io_uring_sqe *sqe = io_uring_get_sqe(&m_ring);
+  if (sqe == nullptr)
+  {
+    // the submission queue is full, push what we have to the kernel
+    submit();
+    sqe = io_uring_get_sqe(&m_ring);
+  }
+
+  nassertr(sqe != nullptr, nullptr);
+  return sqe;
+}
+
+void IoUringBackend::submit()
+{
+  if (!io_uring_sq_ready(&m_ring))
+  {
+    return;
+  }
+
+  int ret = io_uring_submit(&m_ring);
+  if (ret < 0 && ret != -EINTR && ret != -EBUSY)
+  {
+    libotp_cat.warning() << "Failed to submit to io_uring, errno " << -ret << "!" << endl;
+  }
+
+  m_num_submits++;
+}
+
+bool IoUringBackend::listen(const PT(Connection) &rendezvous)
+{
+  if (!m_valid)
+  {
+    return false;
+  }
+
+  m_listen_fd = rendezvous->get_socket()->GetSocket();
+  arm_accept();
+  submit();
+  return true;
+}
+
+void IoUringBackend::add_connection(const PT(Connection) &connection)
+{
+  nassertv(m_valid);
+  if (m_connections.find(connection) != m_connections.end())
+  {
+    return;
+  }
+
+  IoUringConnection *state = new IoUringConnection;
+  state->m_connection = connection;
+  state->m_fd = connection->get_socket()->GetSocket();
+  m_connections.insert(pair<Connection*, IoUringConnection*>(connection, state));
+
+  // armed now, submitted with everything else on the next poll or flush
+  arm_recv(state);
+}
+
+void IoUringBackend::remove_connection(Connection *connection)
+{
+  unordered_map<Connection*, IoUringConnection*>::iterator it = m_connections.find(connection);
+  if (it == m_connections.end())
+  {
+    return;
+  }
+
+  IoUringConnection *state = it->second;
+  m_connections.erase(it);
+  release_connection(state);
+}
+
+bool IoUringBackend::is_connection_ok(Connection *connection)
+{
+  unordered_map<Connection*, IoUringConnection*>::iterator it = m_connections.find(connection);
+  return it != m_connections.end() && !it->second->m_lost;
+}
+
+void IoUringBackend::poll(vector<NetDatagram> &datagrams, vector<int> &accepted)
+{
+  submit();
+
+  struct io_uring_cqe *cqes[IO_URING_CQE_BATCH];
+  unsigned count;
+  while ((count = io_uring_peek_batch_cqe(&m_ring, cqes, IO_URING_CQE_BATCH)) > 0)
+  {
+    for (unsigned i = 0; i < count; i++)
+    {
+      struct io_uring_cqe *cqe = cqes[i];
+      uint64_t user_data = io_uring_cqe_get_data64(cqe);
+      IoUringConnection *connection = (IoUringConnection*)(uintptr_t)(user_data & ~(uint64_t)IO_URING_OP_MASK);
+
+      switch (user_data & IO_URING_OP_MASK)
+      {
+        case IO_URING_OP_ACCEPT:
+          handle_accept(cqe, accepted);
+          break;
+        case IO_URING_OP_RECV:
+          handle_recv(connection, cqe);
+          break;
+        case IO_URING_OP_SEND:
+          handle_send(connection, cqe);
+          break;
+        default:
+          break;
+      }
+    }
+
+    io_uring_cq_advance(&m_ring, count);
+  }
+
+  // anything that stopped receiving because the buffer ring ran dry can go
+  // again now that we've handed every buffer back
+  if (!m_accept_armed && m_listen_fd >= 0)
+  {
+    arm_accept();
+  }
+
+  for (IoUringConnection *connection : m_rearm_list)
+  {
+    connection->m_rearming = false;
+    if (!connection->m_recv_armed && !connection->m_lost)
+    {
+      arm_recv(connection);
+    }
+  }
+
+  m_rearm_list.clear();
+  submit();
+
+  for (uint8_t lane = 0; lane < NUM_NETWORK_LANES; lane++)
+  {
+    vector<NetDatagram> &queue = m_lanes[lane];
+    datagrams.insert(datagrams.end(), queue.begin(), queue.end());
+    queue.clear();
+  }
+}
+
+void IoUringBackend::flush()
+{
+  for (IoUringConnection *connection : m_flush_list)
+  {
+    connection->m_flushing = false;
+    if (!connection->m_send_armed && !connection->m_lost)
+    {
+      arm_send(connection);
+    }
+  }
+
+  m_flush_list.clear();
+  submit();
+}
+
+bool IoUringBackend::send_frame(const Datagram &framed, const PT(Connection) &connection)
+{
+  unordered_map<Connection*, IoUringConnection*>::iterator it = m_connections.find(connection);
+  if (it == m_connections.end() || it->second->m_lost)
+  {
+    return false;
+  }
+
+  // everything sent to a connection during a frame goes out in one send,
+  // up until a peer that isn't reading has left too much of it behind
+  IoUringConnection *state = it->second;
+  if (state->m_outbound.size() + framed.get_length() > m_max_outbound)
+  {
+    return false;
+  }
+
+  state->m_outbound.append((const char*)framed.get_data(), framed.get_length());
+  state->m_outbound_frames++;
+
+  if (!state->m_flushing)
+  {
+    state->m_flushing = true;
+    m_flush_list.push_back(state);
+  }
+
+  return true;
+}
+
+size_t IoUringBackend::get_queue_size(const PT(Connection) &connection)
+{
+  // frames waiting to be coalesced count just the same as those the kernel
+  // is still sending, both are held on our side of the socket
+  unordered_map<Connection*, IoUringConnection*>::iterator it = m_connections.find(connection);
+  if (it == m_connections.end())
+  {
+    return 0;
+  }
+
+  return it->second->m_outbound_frames + it->second->m_sending_frames;
+}
+
+void IoUringBackend::arm_accept()
+{
+  struct io_uring_sqe *sqe = get_sqe();
+  io_uring_prep_multishot_accept(sqe, m_listen_fd, nullptr, nullptr, SOCK_CLOEXEC);
+  io_uring_sqe_set_data64(sqe, get_user_data(nullptr, IO_URING_OP_ACCEPT));
+  m_accept_armed = true;
+}
+
+void IoUringBackend::arm_recv(IoUringConnection *connection)
+{
+  struct io_uring_sqe *sqe = get_sqe();
+  io_uring_prep_recv_multishot(sqe, connection->m_fd, nullptr, 0, 0);
+  sqe->flags |= IOSQE_BUFFER_SELECT;
+  sqe->buf_group = IO_URING_BUFFER_GROUP;
+  io_uring_sqe_set_data64(sqe, get_user_data(connection, IO_URING_OP_RECV));
+  connection->m_recv_armed = true;
+}
+
+void IoUringBackend::arm_send(IoUringConnection *connection)
+{
+  // only one send is ever in flight per connection, so a short send can't
+  // get overtaken by the one after it
+  if (connection->m_sending.empty())
+  {
+    connection->m_sending.swap(connection->m_outbound);
+    connection->m_sending_frames = connection->m_outbound_frames;
+    connection->m_outbound_frames = 0;
+    connection->m_sent = 0;
+  }
+
+  if (connection->m_sending.empty())
+  {
+    return;
+  }
+
+  struct io_uring_sqe *sqe = get_sqe();
+  io_uring_prep_send(sqe, connection->m_fd, connection->m_sending.data() + connection->m_sent,
+                     connection->m_sending.size() - connection->m_sent, MSG_NOSIGNAL);
+  io_uring_sqe_set_data64(sqe, get_user_data(connection, IO_URING_OP_SEND));
+  connection->m_send_armed = true;
+}
+
+void IoUringBackend::handle_accept(struct io_uring_cqe *cqe, vector<int> &accepted)
+{
+  if (!(cqe->flags & IORING_CQE_F_MORE))
+  {
+    m_accept_armed = false;
+  }
+
+  if (cqe->res >= 0)
+  {
+    accepted.push_back(cqe->res);
+    return;
+  }
+
+  if (cqe->res != -ECANCELED && cqe->res != -ECONNABORTED && cqe->res != -EINTR)
+  {
+    libotp_cat.warning() << "Failed to accept a connection, errno " << -cqe->res << "!" << endl;
+  }
+}
+
+void IoUringBackend::handle_recv(IoUringConnection *connection, struct io_uring_cqe *cqe)
+{
+  bool more = (cqe->flags & IORING_CQE_F_MORE) != 0;
+  if (!more)
+  {
+    connection->m_recv_armed = false;
+  }
+
+  if (cqe->flags & IORING_CQE_F_BUFFER)
+  {
+    unsigned short id = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+    unsigned char *buffer = m_buffers + (size_t)id * m_buffer_size;
+    if (cqe->res > 0 && !connection->m_closed && !connection->m_lost)
+    {
+      connection->m_inbound.append((const char*)buffer, cqe->res);
+    }
+
+    // we copied out of the buffer, hand it straight back to the kernel
+    io_uring_buf_ring_add(m_buf_ring, buffer, m_buffer_size, id, io_uring_buf_ring_mask(m_num_buffers), 0);
+    io_uring_buf_ring_advance(m_buf_ring, 1);
+  }
+
+  if (connection->m_closed)
+  {
+    retire_connection(connection);
+    return;
+  }
+
+  if (cqe->res > 0 || cqe->res == -ENOBUFS)
+  {
+    if (cqe->res > 0)
+    {
+      read_frames(connection);
+    }
+
+    if (!more && !connection->m_rearming)
+    {
+      connection->m_rearming = true;
+      m_rearm_list.push_back(connection);
+    }
+
+    return;
+  }
+
+  // the other end hung up, or the connection failed
+  lost_connection(connection);
+}
+
+void IoUringBackend::handle_send(IoUringConnection *connection, struct io_uring_cqe *cqe)
+{
+  connection->m_send_armed = false;
+  if (connection->m_closed)
+  {
+    retire_connection(connection);
+    return;
+  }
+
+  if (cqe->res < 0)
+  {
+    connection->m_sending.clear();
+    connection->m_sending_frames = 0;
+    lost_connection(connection);
+    return;
+  }
+
+  connection->m_sent += cqe->res;
+  if (connection->m_sent < connection->m_sending.size())
+  {
+    // a short send, the rest goes out before anything queued behind it
+    arm_send(connection);
+    return;
+  }
+
+  m_num_sent += connection->m_sending_frames;
+  connection->m_sending.clear();
+  connection->m_sending_frames = 0;
+  connection->m_sent = 0;
+
+  if (!connection->m_outbound.empty() && !connection->m_flushing)
+  {
+    connection->m_flushing = true;
+    m_flush_list.push_back(connection);
+  }
+}
+
+void IoUringBackend::read_frames(IoUringConnection *connection)
+{
+  string &inbound = connection->m_inbound;
+  if (m_tcp_header_size == 0)
+  {
+    // no framing at all, whatever arrived is the datagram
+    NetDatagram datagram(inbound.data(), inbound.size());
+    datagram.set_connection(connection->m_connection);
+    m_lanes[get_datagram_lane(inbound.data(), inbound.size())].push_back(datagram);
+    m_num_received++;
+    inbound.clear();
+    return;
+  }
+
+  size_t offset = 0;
+  while (inbound.size() - offset >= (size_t)m_tcp_header_size)
+  {
+    const unsigned char *header = (const unsigned char*)inbound.data() + offset;
+    size_t length = header[0] | (header[1] << 8);
+    if (m_tcp_header_size == 4)
+    {
+      length |= (header[2] << 16) | ((size_t)header[3] << 24);
+    }
+
+    if (inbound.size() - offset - m_tcp_header_size < length)
+    {
+      break;
+    }
+
+    const char *payload = inbound.data() + offset + m_tcp_header_size;
+    NetDatagram datagram(payload, length);
+    datagram.set_connection(connection->m_connection);
+    m_lanes[get_datagram_lane(payload, length)].push_back(datagram);
+    m_num_received++;
+
+    offset += m_tcp_header_size + length;
+  }
+
+  inbound.erase(0, offset);
+}
+
+void IoUringBackend::lost_connection(IoUringConnection *connection)
+{
+  if (connection->m_lost)
+  {
+    return;
+  }
+
+  // an empty datagram tells the owner to disconnect, the same as the
+  // connection reader does
+  connection->m_lost = true;
+  NetDatagram datagram;
+  datagram.set_connection(connection->m_connection);
+  m_lanes[NETWORK_LANE_BULK].push_back(datagram);
+}
+
+void IoUringBackend::release_connection(IoUringConnection *connection)
+{
+  connection->m_closed = true;
+  connection->m_outbound.clear();
+  connection->m_outbound_frames = 0;
+
+  if (connection->m_flushing)
+  {
+    m_flush_list.erase(remove(m_flush_list.begin(), m_flush_list.end(), connection), m_flush_list.end());
+    connection->m_flushing = false;
+  }
+
+  if (connection->m_rearming)
+  {
+    m_rearm_list.erase(remove(m_rearm_list.begin(), m_rearm_list.end(), connection), m_rearm_list.end());
+    connection->m_rearming = false;
+  }
+
+  if (connection->m_recv_armed || connection->m_send_armed)
+  {
+    // the socket stays open until the kernel is done with it, shutting it
+    // down ends the multishot receive and any send still in flight
+    shutdown(connection->m_fd, SHUT_RDWR);
+    if (connection->m_recv_armed)
+    {
+      struct io_uring_sqe *sqe = get_sqe();
+      io_uring_prep_cancel64(sqe, get_user_data(connection, IO_URING_OP_RECV), 0);
+      io_uring_sqe_set_data64(sqe, get_user_data(nullptr, IO_URING_OP_CANCEL));
+    }
+
+    m_closing.insert(connection);
+    return;
+  }
+
+  delete connection;
+}
+
+void IoUringBackend::retire_connection(IoUringConnection *connection)
+{
+  if (connection->m_recv_armed || connection->m_send_armed)
+  {
+    return;
+  }
+
+  m_closing.erase(connection);
+  delete connection;
+}
+
+#else
+
+IoUringBackend::IoUringBackend(int tcp_header_size)
+{
+
+}
+
+IoUringBackend::~IoUringBackend()
+{
+
+}
+
+bool IoUringBackend::is_valid()
+{
+  // built without liburing
+  return false;
+}
+
+bool IoUringBackend::listen(const PT(Connection) &rendezvous)
+{
+  return false;
+}
+
+void IoUringBackend::add_connection(const PT(Connection) &connection)
+{
+
+}
+
+void IoUringBackend::remove_connection(Connection *connection)
+{
+
+}
+
+bool IoUringBackend::is_connection_ok(Connection *connection)
+{
+  return false;
+}
+
+void IoUringBackend::poll(vector<NetDatagram> &datagrams, vector<int> &accepted)
+{
+
+}
+
+void IoUringBackend::flush()
+{
+
+}
+
+bool IoUringBackend::send_frame(const Datagram &framed, const PT(Connection) &connection)
+{
+  return false;
+}
+
+size_t IoUringBackend::get_queue_size(const PT(Connection) &connection)
+{
+  return 0;
+}
+
+#endif
@@ -0,0 +1,118 @@
+// Copyright (c) 2019, Caleb Marshall.
+//
+// This file is part of Toontown OTP.
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+//
+// You should have received a copy of the MIT License
+// along with Toontown OTP. If not, see <https://opensource.org/licenses/MIT>.
+
+#pragma once
+
+#include <stdint.h>
+#include <string>
+#include <vector>
+#include <unordered_map>
+#include <unordered_set>
+
+#include "pandabase.h"
+#include "connection.h"
+#include "datagram.h"
+#include "netDatagram.h"
+
+#include "network.h"
+
+#ifdef HAVE_IO_URING
+#include <liburing.h>
+#endif
+
+using namespace std;
+
+class IoUringConnection;
+
+// An io_uring backed replacement for the connection reader, writer and
+// listener on Linux. Connections are accepted with a multishot accept,
+// received into a ring of provided buffers shared by every connection,
+// and everything sent during a frame is coalesced per connection and
+// submitted in a single io_uring_enter. Only available when built with
+// liburing, and only used when the running kernel supports all of it.
+class IoUringBackend : public FrameSink
+{
+public:
+  IoUringBackend(int tcp_header_size);
+  virtual ~IoUringBackend();
+
+  bool is_valid();
+
+  bool listen(const PT(Connection) &rendezvous);
+  void add_connection(const PT(Connection) &connection);
+  void remove_connection(Connection *connection);
+  bool is_connection_ok(Connection *connection);
+
+  // reaps every completion that is ready, received datagrams come out in
+  // lane order and a zero-length datagram means the connection was lost
+  void poll(vector<NetDatagram> &datagrams, vector<int> &accepted);
+  void flush();
+
+  virtual bool send_frame(const Datagram &framed, const PT(Connection) &connection);
+  virtual size_t get_queue_size(const PT(Connection) &connection);
+
+public:
+  uint64_t m_num_submits = 0;
+  uint64_t m_num_received = 0;
+  uint64_t m_num_sent = 0;
+
+#ifdef HAVE_IO_URING
+private:
+  struct io_uring_sqe* get_sqe();
+  void submit();
+
+  void arm_accept();
+  void arm_recv(IoUringConnection *connection);
+  void arm_send(IoUringConnection *connection);
+
+  void handle_accept(struct io_uring_cqe *cqe, vector<int> &accepted);
+  void handle_recv(IoUringConnection *connection, struct io_uring_cqe *cqe);
+  void handle_send(IoUringConnection *connection, struct io_uring_cqe *cqe);
+  void read_frames(IoUringConnection *connection);
+  void lost_connection(IoUringConnection *connection);
+  void release_connection(IoUringConnection *connection);
+  void retire_connection(IoUringConnection *connection);
+
+private:
+  bool m_valid = false;
+  int m_tcp_header_size;
+
+  struct io_uring m_ring;
+  struct io_uring_buf_ring *m_buf_ring = nullptr;
+  unsigned char *m_buffers = nullptr;
+  size_t m_buffer_size = 0;
+  size_t m_max_outbound = 0;
+  size_t m_num_buffers = 0;
+
+  int m_listen_fd = -1;
+  bool m_accept_armed = false;
+
+  unordered_map<Connection*, IoUringConnection*> m_connections;
+  unordered_set<IoUringConnection*> m_closing;
+  vector<IoUringConnection*> m_flush_list;
+  vector<IoUringConnection*> m_rearm_list;
+  vector<NetDatagram> m_lanes[NUM_NETWORK_LANES];
+#endif
+};
@@ -0,0 +1,451 @@
+// Copyright (c) 2019, Caleb Marshall.
+//
+// This file is part of Toontown OTP.
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+//
+// You should have received a copy of the MIT License
+// along with Toontown OTP. If not, see <https://opensource.org/licenses/MIT>.
+
+#include "linkcodec.h"
+#include "network.h"
+#include "messageheader.h"
+#include "config_libotp.h"
+#include "trueClock.h"
+
+#ifdef HAVE_ZLIB
+#include "compress_string.h"
+#include "zStream.h"
+#include <sstream>
+#endif
+
+#define LINK_POOR_RATIO_LIMIT  8
+#define LINK_BYPASS_FRAMES     64
+
+uint8_t get_supported_link_options()
+{
+  uint8_t options = 0;
+#ifdef HAVE_ZLIB
+  if (otp_link_compression)
+  {
+    options |= LINK_OPTION_COMPRESSION;
+  }
+#endif
+
+  if (otp_link_tracing)
+  {
+    options |= LINK_OPTION_TRACING;
+  }
+
+  if (otp_link_fragmentation)
+  {
+    options |= LINK_OPTION_FRAGMENTATION;
+  }
+
+  return options;
+}
+
+LinkCodec::LinkCodec()
+{
+
+}
+
+LinkCodec::~LinkCodec()
+{
+
+}
+
+void LinkCodec::set_options(uint8_t options)
+{
+  m_options = options & get_supported_link_options();
+}
+
+uint8_t LinkCodec::get_options()
+{
+  return m_options;
+}
+
+void LinkCodec::set_negotiated(bool negotiated)
+{
+  m_negotiated = negotiated;
+}
+
+bool LinkCodec::is_negotiated()
+{
+  return m_negotiated;
+}
+
+uint64_t LinkCodec::get_raw_bytes()
+{
+  return m_raw_bytes;
+}
+
+uint64_t LinkCodec::get_wire_bytes()
+{
+  return m_wire_bytes;
+}
+
+uint64_t LinkCodec::get_num_compressed()
+{
+  return m_num_compressed;
+}
+
+uint64_t LinkCodec::get_num_bypassed()
+{
+  return m_num_bypassed;
+}
+
+uint64_t LinkCodec::get_num_rejected()
+{
+  return m_num_rejected;
+}
+
+double LinkCodec::get_compress_time()
+{
+  return m_compress_time;
+}
+
+double LinkCodec::get_decompress_time()
+{
+  return m_decompress_time;
+}
+
+uint64_t LinkCodec::get_num_traced()
+{
+  return m_num_traced;
+}
+
+void LinkCodec::attach_trace(const TraceRecord &trace)
+{
+  m_trace = trace;
+  m_has_trace = true;
+}
+
+bool LinkCodec::has_received_trace()
+{
+  return m_has_received_trace;
+}
+
+uint64_t LinkCodec::get_num_fragmented()
+{
+  return m_num_fragmented;
+}
+
+uint64_t LinkCodec::get_num_reassembled()
+{
+  return m_num_reassembled;
+}
+
+uint64_t LinkCodec::get_num_oversized()
+{
+  return m_num_oversized;
+}
+
+size_t LinkCodec::get_reassembly_size()
+{
+  return m_reassembly.size();
+}
+
+bool LinkCodec::is_incomplete()
+{
+  return m_incomplete;
+}
+
+#ifdef HAVE_ZLIB
+// Inflates a zlib stream a chunk at a time, giving up as soon as the output
+// passes max_length so a tiny frame can't expand into gigabytes. This goes
+// through Panda's decompression stream rather than zlib itself, which
+// isn't something we link against directly.
+static bool inflate_bounded(const unsigned char *data, size_t length, size_t max_length, string &inflated)
+{
+  istringstream source(string((const char*)data, length));
+  IDecompressStream stream(&source, false);
+
+  char buffer[16384];
+  while (stream)
+  {
+    stream.read(buffer, sizeof(buffer));
+    size_t produced = (size_t)stream.gcount();
+    if (inflated.size() + produced > max_length)
+    {
+      return false;
+    }
+
+    inflated.append(buffer, produced);
+  }
+
+  return !stream.bad();
+}
+#endif
+
+bool LinkCodec::encode(const void *data, size_t length, Datagram &encoded)
+{
+  // control messages always go out exactly as they are, the reader sorts
+  // them into the control lane by their first bytes before any decoding
+  if (get_datagram_lane(data, length) == NETWORK_LANE_CONTROL)
+  {
+    return false;
+  }
+
+  if (!m_has_trace)
+  {
+    return encode_frame(data, length, encoded);
+  }
+
+  m_has_trace = false;
+  if (!(m_options & LINK_OPTION_TRACING))
+  {
+    return encode_frame(data, length, encoded);
+  }
+
+  // a trace frame wraps the frame we would have sent anyway, with the
+  // trailer on the end where the hops along the way can stamp it
+  Datagram inner;
+  encoded.add_uint8(LINK_FRAME_TRACE);
+  if (encode_frame(data, length, inner))
+  {
+    encoded.append_data(inner.get_data(), inner.get_length());
+  }
+  else
+  {
+    encoded.append_data(data, length);
+  }
+
+  m_trace.write(encoded);
+  m_wire_bytes += 1 + TRACE_TRAILER_SIZE;
+  m_num_traced++;
+  return true;
+}
+
+bool LinkCodec::encode_frame(const void *data, size_t length, Datagram &encoded)
+{
+  const unsigned char *bytes = (const unsigned char*)data;
+  if (!m_negotiated)
+  {
+    return false;
+  }
+
+  m_raw_bytes += length;
+
+#ifdef HAVE_ZLIB
+  if ((m_options & LINK_OPTION_COMPRESSION) && length >= (size_t)otp_link_compression_threshold)
+  {
+    if (m_bypass_count > 0)
+    {
+      m_bypass_count--;
+      m_num_bypassed++;
+    }
+    else
+    {
+      TrueClock *clock = TrueClock::get_global_ptr();
+      double start = clock->get_short_time();
+      string compressed = compress_string(string((const char*)data, length), otp_link_compression_level);
+      m_compress_time += clock->get_short_time() - start;
+
+      if (!compressed.empty() && compressed.size() + 1 < length * otp_link_compression_ratio)
+      {
+        m_poor_ratio_count = 0;
+        m_num_compressed++;
+
+        encoded.add_uint8(LINK_FRAME_ZLIB);
+        encoded.append_data(compressed.data(), compressed.size());
+        m_wire_bytes += encoded.get_length();
+        return true;
+      }
+
+      if (++m_poor_ratio_count >= LINK_POOR_RATIO_LIMIT)
+      {
+        m_poor_ratio_count = 0;
+        m_bypass_count = LINK_BYPASS_FRAMES;
+      }
+    }
+  }
+#endif
+
+  m_wire_bytes += length;
+  if (!length || bytes[0] < LINK_FRAME_MARKER)
+  {
+    return false;
+  }
+
+  // the first byte collides with our frame markers, escape it
+  encoded.add_uint8(LINK_FRAME_RAW);
+  encoded.append_data(data, length);
+  m_wire_bytes++;
+  return true;
+}
+
+bool LinkCodec::is_encoded(const Datagram &datagram)
+{
+  if (!m_negotiated || !datagram.get_length())
+  {
+    return false;
+  }
+
+  return ((const unsigned char*)datagram.get_data())[0] >= LINK_FRAME_MARKER;
+}
+
+bool LinkCodec::decode(const Datagram &datagram, Datagram &decoded)
+{
+  m_has_received_trace = false;
+  m_incomplete = false;
+  return decode_bytes((const unsigned char*)datagram.get_data(), datagram.get_length(), decoded, true);
+}
+
+bool LinkCodec::decode_bytes(const unsigned char *bytes, size_t length, Datagram &decoded, bool allow_fragments)
+{
+  if (!length)
+  {
+    return false;
+  }
+
+  if (bytes[0] == LINK_FRAME_FRAGMENT)
+  {
+    return allow_fragments && decode_fragment(bytes, length, decoded);
+  }
+
+  if (bytes[0] != LINK_FRAME_TRACE)
+  {
+    return decode_frame(bytes, length, decoded);
+  }
+
+  if (length < 1 + TRACE_TRAILER_SIZE)
+  {
+    return false;
+  }
+
+  m_received_trace.read(bytes + length - TRACE_TRAILER_SIZE);
+  m_has_received_trace = true;
+
+  // the wrapped frame is either a plain message or another encoded frame
+  const unsigned char *inner = bytes + 1;
+  size_t inner_length = length - 1 - TRACE_TRAILER_SIZE;
+  if (!inner_length || inner[0] < LINK_FRAME_MARKER)
+  {
+    decoded.append_data(inner, inner_length);
+    return true;
+  }
+
+  if (inner[0] == LINK_FRAME_TRACE || inner[0] == LINK_FRAME_FRAGMENT)
+  {
+    return false;
+  }
+
+  return decode_frame(inner, inner_length, decoded);
+}
+
+bool LinkCodec::decode_fragment(const unsigned char *bytes, size_t length, Datagram &decoded)
+{
+  if (length < LINK_FRAGMENT_HEADER_SIZE)
+  {
+    return false;
+  }
+
+  uint32_t id = load_uint32(bytes + 1);
+  uint32_t message_length = load_uint32(bytes + 5);
+  const unsigned char *chunk = bytes + LINK_FRAGMENT_HEADER_SIZE;
+  size_t chunk_length = length - LINK_FRAGMENT_HEADER_SIZE;
+
+  if (!m_reassembling || id != m_fragment_id)
+  {
+    // the start of a new message, anything left of the last one is gone
+    m_reassembling = true;
+    m_fragment_id = id;
+    m_fragment_length = message_length;
+    m_fragment_received = 0;
+    string().swap(m_reassembly);
+
+    // a message larger than we are willing to buffer is still read off the
+    // link, just thrown away as it comes in. the buffer only grows as the
+    // chunks actually arrive, a header alone can't make us allocate
+    m_oversized = message_length > (uint32_t)otp_fragment_max_size;
+  }
+
+  if (message_length != m_fragment_length || chunk_length > m_fragment_length - m_fragment_received)
+  {
+    m_reassembling = false;
+    string().swap(m_reassembly);
+    return false;
+  }
+
+  if (!m_oversized)
+  {
+    m_reassembly.append((const char*)chunk, chunk_length);
+  }
+
+  m_fragment_received += chunk_length;
+  if (m_fragment_received < m_fragment_length)
+  {
+    m_incomplete = true;
+    return true;
+  }
+
+  m_reassembling = false;
+  if (m_oversized)
+  {
+    m_num_oversized++;
+    return false;
+  }
+
+  m_num_reassembled++;
+
+  // hand the buffer back, a burst of large messages shouldn't pin memory
+  string message;
+  message.swap(m_reassembly);
+  const unsigned char *message_bytes = (const unsigned char*)message.data();
+  if (message.empty() || message_bytes[0] < LINK_FRAME_MARKER)
+  {
+    decoded.append_data(message.data(), message.size());
+    return true;
+  }
+
+  return decode_bytes(message_bytes, message.size(), decoded, false);
+}
+
+bool LinkCodec::decode_frame(const unsigned char *bytes, size_t length, Datagram &decoded)
+{
+  switch (bytes[0])
+  {
+    case LINK_FRAME_RAW:
+      {
+        decoded.append_data(bytes + 1, length - 1);
+      }
+      return true;
+#ifdef HAVE_ZLIB
+    case LINK_FRAME_ZLIB:
+      {
+        TrueClock *clock = TrueClock::get_global_ptr();
+        double start = clock->get_short_time();
+        string decompressed;
+        bool inflated = inflate_bounded(bytes + 1, length - 1, (size_t)max(otp_link_max_decompressed_size.get_value(), 0), decompressed);
+        m_decompress_time += clock->get_short_time() - start;
+        if (!inflated || decompressed.empty())
+        {
+          m_num_rejected++;
+          return false;
+        }
+
+        decoded.append_data(decompressed.data(), decompressed.size());
+      }
+      return true;
+#endif
+    default:
+      return false;
+  }
+}
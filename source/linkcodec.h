@@ -0,0 +1,133 @@
+// Copyright (c) 2019, Caleb Marshall.
+//
+// This file is part of Toontown OTP.
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+//
+// You should have received a copy of the MIT License
+// along with Toontown OTP. If not, see <https://opensource.org/licenses/MIT>.
+
+#pragma once
+
+#include <stdint.h>
+#include <string.h>
+#include <string>
+
+#include "pandabase.h"
+#include "datagram.h"
+
+#include "msgtypes.h"
+#include "trace.h"
+
+using namespace std;
+
+// Returns the link options this process is willing to use, as a mask of
+// the LINK_OPTION_* flags.
+uint8_t get_supported_link_options();
+
+// Encodes and decodes the frames on a link once it has been negotiated with
+// CONTROL_SET_LINK_OPTIONS. A frame whose first byte is below LINK_FRAME_MARKER
+// is sent unchanged, so plain messages cost nothing and stay readable by
+// either end while the negotiation is in flight. The options only decide
+// what we encode, any negotiated link can decode every frame type.
+class LinkCodec
+{
+PUBLISHED:
+  LinkCodec();
+  ~LinkCodec();
+
+  void set_options(uint8_t options);
+  uint8_t get_options();
+
+  void set_negotiated(bool negotiated);
+  bool is_negotiated();
+
+  uint64_t get_raw_bytes();
+  uint64_t get_wire_bytes();
+  uint64_t get_num_compressed();
+  uint64_t get_num_bypassed();
+  uint64_t get_num_rejected();
+  double get_compress_time();
+  double get_decompress_time();
+  uint64_t get_num_traced();
+  uint64_t get_num_fragmented();
+  uint64_t get_num_reassembled();
+  uint64_t get_num_oversized();
+  size_t get_reassembly_size();
+
+public:
+  bool encode(const void *data, size_t length, Datagram &encoded);
+  bool is_encoded(const Datagram &datagram);
+  bool decode(const Datagram &datagram, Datagram &decoded);
+
+  // the next frame encoded carries this trace, if the link traces at all
+  void attach_trace(const TraceRecord &trace);
+
+  // true if the last frame decoded carried a trace, which is left in
+  // m_received_trace until the next decode
+  bool has_received_trace();
+
+  // true if the last frame decoded was a fragment of a message that isn't
+  // complete yet, there is nothing to deliver until it is
+  bool is_incomplete();
+
+private:
+  bool encode_frame(const void *data, size_t length, Datagram &encoded);
+  bool decode_bytes(const unsigned char *bytes, size_t length, Datagram &decoded, bool allow_fragments);
+  bool decode_frame(const unsigned char *bytes, size_t length, Datagram &decoded);
+  bool decode_fragment(const unsigned char *bytes, size_t length, Datagram &decoded);
+
+public:
+  uint8_t m_options = 0;
+  bool m_negotiated = false;
+
+  // adaptive bypass, a run of poorly compressing frames turns compression
+  // off for a while before we try again
+  uint32_t m_poor_ratio_count = 0;
+  uint32_t m_bypass_count = 0;
+
+  uint64_t m_raw_bytes = 0;
+  uint64_t m_wire_bytes = 0;
+  uint64_t m_num_compressed = 0;
+  uint64_t m_num_bypassed = 0;
+  uint64_t m_num_rejected = 0;
+  double m_compress_time = 0.0;
+  double m_decompress_time = 0.0;
+
+  TraceRecord m_trace;
+  bool m_has_trace = false;
+  TraceRecord m_received_trace;
+  bool m_has_received_trace = false;
+  uint64_t m_num_traced = 0;
+
+  // fragments go out one message at a time and arrive in order, so there
+  // is only ever one message being reassembled per link
+  uint32_t m_next_fragment_id = 0;
+  uint32_t m_fragment_id = 0;
+  uint32_t m_fragment_length = 0;
+  uint32_t m_fragment_received = 0;
+  bool m_reassembling = false;
+  bool m_oversized = false;
+  bool m_incomplete = false;
+  string m_reassembly;
+
+  uint64_t m_num_fragmented = 0;
+  uint64_t m_num_reassembled = 0;
+  uint64_t m_num_oversized = 0;
+};
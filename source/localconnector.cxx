@@ -0,0 +1,187 @@
+// Copyright (c) 2019, Caleb Marshall.
+//
+// This file is part of Toontown OTP.
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+//
+// You should have received a copy of the MIT License
+// along with Toontown OTP. If not, see <https://opensource.org/licenses/MIT>.
+
+#include "localconnector.h"
+#include "config_libotp.h"
+
+TypeHandle LocalConnector::_type_handle;
+
+LocalParticipant::LocalParticipant(MessageDirector *messagedirector, LocalConnector *connector)
+  : Participant(messagedirector, messagedirector->m_interface, nullptr, NetAddress(), nullptr), m_connector(connector)
+{
+
+}
+
+LocalParticipant::~LocalParticipant()
+{
+
+}
+
+bool LocalParticipant::send_datagram(Datagram &datagram)
+{
+  assert(m_connector != nullptr);
+  m_connector->deliver_datagram(datagram);
+  return true;
+}
+
+LocalConnector::LocalConnector(MessageDirector *messagedirector, bool queued)
+  : m_messagedirector(messagedirector), m_queued(queued)
+{
+  assert(messagedirector != nullptr);
+  m_participant = new LocalParticipant(messagedirector, this);
+
+  if (m_queued)
+  {
+    m_reader_task = new GenericAsyncTask("_local_reader_task", &LocalConnector::reader_poll, this);
+    task_mgr->add(m_reader_task);
+  }
+}
+
+LocalConnector::~LocalConnector()
+{
+  if (m_reader_task != nullptr)
+  {
+    task_mgr->remove(m_reader_task);
+  }
+
+  disconnect();
+}
+
+bool LocalConnector::send_datagram(Datagram &datagram)
+{
+  if (m_participant == nullptr)
+  {
+    return false;
+  }
+
+  // straight into the same handling a remote participant's messages get
+  // once they're off the wire
+  m_num_sent++;
+  DatagramIterator iterator(datagram);
+  m_participant->receive_datagram(iterator);
+  return true;
+}
+
+void LocalConnector::receive_datagram(DatagramIterator &iterator)
+{
+
+}
+
+void LocalConnector::disconnected()
+{
+
+}
+
+void LocalConnector::disconnect()
+{
+  if (m_participant == nullptr)
+  {
+    return;
+  }
+
+  // the participant's post removes go out just as they would for a remote
+  // participant dropping its connection
+  LocalParticipant *participant = m_participant;
+  m_participant = nullptr;
+  participant->disconnected();
+  delete participant;
+
+  m_queue.clear();
+  disconnected();
+}
+
+bool LocalConnector::is_connected()
+{
+  return m_participant != nullptr;
+}
+
+bool LocalConnector::is_queued()
+{
+  return m_queued;
+}
+
+size_t LocalConnector::get_num_queued()
+{
+  return m_queue.size();
+}
+
+uint64_t LocalConnector::get_num_sent()
+{
+  return m_num_sent;
+}
+
+uint64_t LocalConnector::get_num_received()
+{
+  return m_num_received;
+}
+
+void LocalConnector::deliver_datagram(const Datagram &datagram)
+{
+  // a direct connector that sends from inside receive_datagram may well
+  // have something routed straight back to it, that waits until the call
+  // it's nested in returns instead of recursing any deeper
+  if (m_queued || m_delivering)
+  {
+    m_queue.push_back(datagram);
+    return;
+  }
+
+  m_delivering = true;
+  m_num_received++;
+  DatagramIterator iterator(datagram);
+  receive_datagram(iterator);
+
+  while (!m_queue.empty())
+  {
+    Datagram queued = m_queue.front();
+    m_queue.pop_front();
+
+    m_num_received++;
+    DatagramIterator queued_iterator(queued);
+    receive_datagram(queued_iterator);
+  }
+
+  m_delivering = false;
+}
+
+AsyncTask::DoneStatus LocalConnector::reader_poll(GenericAsyncTask *task, void *data)
+{
+  LocalConnector *self = (LocalConnector*)data;
+
+  // only what was queued before this frame, anything routed back to us
+  // while we're handling it waits for the next one like it would on a link
+  size_t num_queued = self->m_queue.size();
+  for (size_t i = 0; i < num_queued && !self->m_queue.empty(); i++)
+  {
+    Datagram datagram = self->m_queue.front();
+    self->m_queue.pop_front();
+
+    self->m_num_received++;
+    DatagramIterator iterator(datagram);
+    self->receive_datagram(iterator);
+  }
+
+  return AsyncTask::DS_cont;
+}
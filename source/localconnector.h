@@ -0,0 +1,124 @@
+// Copyright (c) 2019, Caleb Marshall.
+//
+// This file is part of Toontown OTP.
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+//
+// You should have received a copy of the MIT License
+// along with Toontown OTP. If not, see <https://opensource.org/licenses/MIT>.
+
+#pragma once
+
+#include <stdint.h>
+#include <deque>
+
+#include "pandabase.h"
+#include "datagram.h"
+#include "datagramIterator.h"
+
+#include "network.h"
+#include "messagedirector.h"
+
+class LocalConnector;
+
+// The message director's end of an in-process participant. It's routed to
+// exactly like a remote one, only what would be framed and written to a
+// socket is handed straight to its connector instead.
+class LocalParticipant : public Participant
+{
+public:
+  ALLOC_DELETED_CHAIN(LocalParticipant);
+
+  LocalParticipant(MessageDirector *messagedirector, LocalConnector *connector);
+  ~LocalParticipant();
+
+  virtual bool send_datagram(Datagram &datagram);
+
+public:
+  LocalConnector *m_connector = nullptr;
+};
+
+// Stands in for a NetworkConnector when the participant lives in the same
+// process as the MessageDirector, e.g. an UberDOG. Messages go straight
+// into routing and come back without any socket, framing or reader queue
+// in between. Queued connectors get their messages from a task each frame
+// just like a NetworkConnector would, direct ones have receive_datagram
+// called from inside routing. A direct connector may send from its own
+// receive_datagram, anything routed back to it meanwhile is delivered
+// once that call returns rather than nested inside it.
+class LocalConnector : public TypedObject
+{
+PUBLISHED:
+  LocalConnector(MessageDirector *messagedirector, bool queued=true);
+  virtual ~LocalConnector();
+
+  bool send_datagram(Datagram &datagram);
+  virtual void receive_datagram(DatagramIterator &iterator);
+  virtual void disconnected();
+  void disconnect();
+
+  bool is_connected();
+  bool is_queued();
+  size_t get_num_queued();
+  uint64_t get_num_sent();
+  uint64_t get_num_received();
+
+public:
+  void deliver_datagram(const Datagram &datagram);
+
+private:
+  static AsyncTask::DoneStatus reader_poll(GenericAsyncTask *task, void *data);
+
+private:
+  MessageDirector *m_messagedirector = nullptr;
+  LocalParticipant *m_participant = nullptr;
+  bool m_queued = true;
+  bool m_delivering = false;
+  deque<Datagram> m_queue;
+  uint64_t m_num_sent = 0;
+  uint64_t m_num_received = 0;
+
+  PT(GenericAsyncTask) m_reader_task;
+
+public:
+  static TypeHandle get_class_type()
+  {
+    return _type_handle;
+  }
+
+  static void init_type()
+  {
+    TypedObject::init_type();
+    register_type(_type_handle, "LocalConnector", TypedObject::get_class_type());
+  }
+
+  virtual TypeHandle get_type() const
+  {
+    return get_class_type();
+  }
+
+  virtual TypeHandle force_init_type()
+  {
+    init_type();
+    return get_class_type();
+  }
+
+private:
+  static TypeHandle _type_handle;
+};
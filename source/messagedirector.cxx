@@ -24,6 +24,19 @@
 // along with Toontown OTP. If not, see <https://opensource.org/licenses/MIT>.
 
 #include "messagedirector.h"
+#include "config_libotp.h"
+
+#ifdef _WIN32
+#include <fstream>
+#else
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+
+#define SNAPSHOT_MAGIC    0x5350544f
+#define SNAPSHOT_VERSION  1
 
 Participant::Participant(MessageDirector *acceptor, ParticipantInterface *interface, PT(Connection) rendezvous, NetAddress address, PT(Connection) connection)
   : m_interface(interface), NetworkHandler(acceptor, rendezvous, address, connection)
@@ -38,22 +51,39 @@ Participant::~Participant()
 
 void Participant::receive_datagram(DatagramIterator &iterator)
 {
-  uint64_t channels = iterator.get_uint8();
-  uint64_t channel = iterator.get_uint64();
-  if (channels == 1 && channel == CONTROL_MESSAGE)
+  const Datagram &raw_datagram = iterator.get_datagram();
+  size_t offset = iterator.get_current_index();
+
+  MessageHeader header;
+  if (!header.parse((const unsigned char*)raw_datagram.get_data() + offset, raw_datagram.get_length() - offset))
+  {
+    libotp_cat.warning() << "Dropping a malformed datagram from " << m_address.get_ip_string() << "!" << endl;
+    return;
+  }
+
+  DatagramIterator payload(raw_datagram, offset + header.m_header_length);
+  if (header.m_control)
   {
-    uint16_t message_type = iterator.get_uint16();
-    uint64_t sender = iterator.get_uint64();
-    switch (message_type)
+    uint64_t sender = header.m_sender;
+    switch (header.m_message_type)
     {
       case CONTROL_SET_CHANNEL:
         {
+          if (!m_interface->can_add_channel(this))
+          {
+            break;
+          }
+
           if (!m_channel)
           {
+            // the first channel identifies a participant, so this is where
+            // it gets back anything restored from a snapshot
             m_channel = sender;
+            m_interface->claim_snapshot(this);
           }
 
           m_interface->add_participant(sender, this);
+          m_interface->check_memory(this);
         }
         break;
       case CONTROL_REMOVE_CHANNEL:
@@ -62,6 +92,38 @@ void Participant::receive_datagram(DatagramIterator &iterator)
           m_interface->remove_participant(sender);
         }
         break;
+      case CONTROL_ADD_CHANNELS:
+      case CONTROL_REMOVE_CHANNELS:
+        {
+          // a uint32 count followed by that many channels
+          if (header.m_payload_length < 4 || (header.m_payload_length - 4) / 8 < load_uint32(header.m_payload))
+          {
+            libotp_cat.warning() << "Dropping a malformed channel list from " << m_address.get_ip_string() << "!" << endl;
+            break;
+          }
+
+          vector<uint64_t> channels(load_uint32(header.m_payload));
+          for (size_t i = 0; i < channels.size(); i++)
+          {
+            channels[i] = load_uint64(header.m_payload + 4 + i * 8);
+          }
+
+          if (header.m_message_type == CONTROL_REMOVE_CHANNELS)
+          {
+            m_interface->remove_participants(this, channels);
+            break;
+          }
+
+          if (!m_channel && !channels.empty() && channels[0])
+          {
+            m_channel = channels[0];
+            m_interface->claim_snapshot(this);
+          }
+
+          m_interface->add_participants(this, channels);
+          m_interface->check_memory(this);
+        }
+        break;
       case CONTROL_SET_CON_NAME:
         break;
       case CONTROL_SET_CON_URL:
@@ -72,44 +134,168 @@ void Participant::receive_datagram(DatagramIterator &iterator)
         break;
       case CONTROL_ADD_POST_REMOVE:
         {
-          if (iterator.get_remaining_size() > 0)
+          if (header.m_payload_length > 0 && m_interface->can_add_post_remove(this, header.m_payload_length))
           {
-            Datagram *datagram = new Datagram();
-            datagram->append_data(iterator.get_remaining_bytes());
+            // a client replaying its post removes after we restart replaces
+            // whatever we restored for it, rather than adding to them
+            m_interface->drop_restored_post_removes(sender);
 
-            PostRemoveHandle *post_remove = new PostRemoveHandle(sender, datagram);
+            Datagram *datagram = new Datagram(header.m_payload, header.m_payload_length);
+            PostRemoveHandle *post_remove = new PostRemoveHandle(sender, datagram, this);
             m_interface->add_post_remove(sender, post_remove);
+            m_interface->check_memory(this);
           }
         }
         break;
+      case CONTROL_ADD_POST_REMOVES:
+        {
+          // a uint32 count followed by that many post removes, each one a
+          // uint32 length and the datagram, all filed under the sender
+          const unsigned char *data = header.m_payload;
+          size_t remaining = header.m_payload_length;
+          bool valid = remaining >= 4;
+          vector<pair<const unsigned char*, size_t>> datagrams;
+          if (valid)
+          {
+            uint32_t num_post_removes = load_uint32(data);
+            data += 4;
+            remaining -= 4;
+
+            datagrams.reserve(min<size_t>(num_post_removes, remaining / 4));
+            for (uint32_t i = 0; i < num_post_removes; i++)
+            {
+              if (remaining < 4 || remaining - 4 < load_uint32(data))
+              {
+                valid = false;
+                break;
+              }
+
+              size_t length = load_uint32(data);
+              if (length > 0)
+              {
+                datagrams.push_back(pair<const unsigned char*, size_t>(data + 4, length));
+              }
+
+              data += 4 + length;
+              remaining -= 4 + length;
+            }
+          }
+
+          if (!valid)
+          {
+            libotp_cat.warning() << "Dropping a malformed post remove list from " << m_address.get_ip_string() << "!" << endl;
+            break;
+          }
+
+          m_interface->drop_restored_post_removes(sender);
+          m_interface->add_post_removes(this, sender, datagrams);
+          m_interface->check_memory(this);
+        }
+        break;
       case CONTROL_CLEAR_POST_REMOVE:
         {
           m_interface->clear_post_removes(this, sender);
         }
         break;
+      case CONTROL_SET_LINK_OPTIONS:
+        {
+          uint8_t options = 0;
+          if (header.m_payload_length > 0)
+          {
+            options = header.m_payload[0];
+          }
+
+          // let the participant know which options we granted, from here on
+          // we decode its frames and encode ours with those options
+          Datagram datagram;
+          datagram.add_uint8(1);
+          datagram.add_uint64(CONTROL_MESSAGE);
+          datagram.add_uint64(0);
+          datagram.add_uint16(CONTROL_SET_LINK_OPTIONS);
+          datagram.add_uint8(options & get_supported_link_options());
+          send_datagram(datagram);
+
+          m_codec.set_negotiated(true);
+          m_codec.set_options(options);
+        }
+        break;
+      case CONTROL_SET_UDP_ENDPOINT:
+        {
+          // hand out the token the participant proves itself with over
+          // UDP, a zero port tells it we have no side channel
+          uint32_t token = m_interface->m_messagedirector->open_udp_endpoint(this);
+
+          Datagram datagram;
+          datagram.add_uint8(1);
+          datagram.add_uint64(CONTROL_MESSAGE);
+          datagram.add_uint64(0);
+          datagram.add_uint16(CONTROL_SET_UDP_ENDPOINT);
+          datagram.add_uint16(token ? m_interface->m_messagedirector->get_udp_port() : 0);
+          datagram.add_uint32(token);
+          send_datagram(datagram);
+        }
+        break;
       default:
+        m_interface->dispatch_message(this, CONTROL_MESSAGE, sender, header.m_message_type, payload);
         return;
     }
   }
   else
   {
-    uint64_t sender = iterator.get_uint64();
-    uint16_t message_type = iterator.get_uint16();
-    Datagram datagram(iterator.get_remaining_bytes());
-    m_interface->route_datagram(channel, sender, message_type, datagram);
+    if (m_interface->dispatch_message(this, header.get_channel(0), header.m_sender, header.m_message_type, payload))
+    {
+      return;
+    }
+
+    m_interface->route_message(header);
   }
 }
 
 void Participant::disconnected()
 {
   m_interface->clear_post_removes(this, m_channel);
-  m_interface->remove_participant(m_channel);
+  m_interface->remove_participant(this);
+  m_interface->disown_post_removes(this);
+}
+
+size_t Participant::get_num_channels()
+{
+  return m_channels.size();
 }
 
-MessageDirector::MessageDirector(const char *address, uint16_t port, uint32_t backlog, size_t num_threads)
-  : NetworkAcceptor(address, port, backlog, num_threads)
+size_t Participant::get_num_post_removes()
+{
+  return m_post_removes.size();
+}
+
+size_t Participant::get_post_remove_size()
+{
+  return m_post_remove_size;
+}
+
+size_t Participant::get_memory_usage()
+{
+  return m_channels.size() * CHANNEL_ENTRY_SIZE + m_post_remove_size + get_buffered_size();
+}
+
+MessageDirector::MessageDirector(const char *address, uint16_t port, uint32_t backlog, size_t num_threads, uint8_t backend)
+  : NetworkAcceptor(address, port, backlog, num_threads, backend)
 {
   m_interface = new ParticipantInterface(this);
+
+  // warm up the participant free list so a reconnect storm right after we
+  // start doesn't have to go to the heap for every handler
+  vector<void*> participants;
+  participants.reserve(otp_handler_pool_size);
+  for (int i = 0; i < otp_handler_pool_size; i++)
+  {
+    participants.push_back(Participant::operator new(sizeof(Participant)));
+  }
+
+  for (void *participant : participants)
+  {
+    Participant::operator delete(participant);
+  }
 }
 
 MessageDirector::~MessageDirector()
@@ -122,8 +308,13 @@ Participant* MessageDirector::init_handler(PT(Connection) rendezvous, NetAddress
   return new Participant(this, this->m_interface, rendezvous, address, connection);
 }
 
-PostRemoveHandle::PostRemoveHandle(uint64_t sender, Datagram *datagram)
-  : m_sender(sender), m_datagram(datagram)
+ParticipantInterface* MessageDirector::get_interface()
+{
+  return m_interface;
+}
+
+PostRemoveHandle::PostRemoveHandle(uint64_t sender, Datagram *datagram, Participant *participant)
+  : m_sender(sender), m_datagram(datagram), m_participant(participant)
 {
 
 }
@@ -134,17 +325,42 @@ PostRemoveHandle::~PostRemoveHandle()
   delete m_datagram;
 }
 
+size_t PostRemoveHandle::get_size() const
+{
+  return sizeof(PostRemoveHandle) + sizeof(Datagram) + sizeof(PostRemoveHandle*) + m_datagram->get_length();
+}
+
 TypeHandle ParticipantInterface::_type_handle;
 
 ParticipantInterface::ParticipantInterface(MessageDirector *messagedirector)
-  : m_messagedirector(messagedirector)
+  : m_messagedirector(messagedirector),
+    m_snapshot_writing(false),
+    m_snapshot_failed(false)
 {
+  if (!otp_snapshot_path.get_value().empty())
+  {
+    load_snapshot();
 
+    m_snapshot_task = new GenericAsyncTask("_snapshot_task", &ParticipantInterface::snapshot_poll, this);
+    m_snapshot_task->set_delay(otp_snapshot_interval);
+    task_mgr->add(m_snapshot_task);
+  }
 }
 
 ParticipantInterface::~ParticipantInterface()
 {
-
+  if (m_snapshot_task != nullptr)
+  {
+    task_mgr->remove(m_snapshot_task);
+    if (m_snapshot_dirty || m_capturing || m_snapshot_failed)
+    {
+      write_snapshot();
+    }
+    else if (m_snapshot_thread.joinable())
+    {
+      m_snapshot_thread.join();
+    }
+  }
 }
 
 bool ParticipantInterface::has_participant(uint64_t channel)
@@ -156,16 +372,8 @@ bool ParticipantInterface::has_participant(uint64_t channel)
 
 bool ParticipantInterface::has_participant(Participant *participant)
 {
-  unordered_map<uint64_t, Participant*>::iterator it = m_channels_map.begin();
-  for (; it != m_channels_map.end(); ++it)
-  {
-    if (it->second == participant)
-    {
-      return true;
-    }
-  }
-
-  return false;
+  assert(participant != nullptr);
+  return !participant->m_channels.empty();
 }
 
 void ParticipantInterface::add_participant(uint64_t channel, Participant *participant)
@@ -176,12 +384,53 @@ void ParticipantInterface::add_participant(uint64_t channel, Participant *partic
     return;
   }
 
-  if (has_participant(channel))
+  if (!m_channels_map.insert(pair<uint64_t, Participant*>(channel, participant)).second)
+  {
+    return;
+  }
+
+  participant->m_channels.insert(channel);
+  m_snapshot_dirty = true;
+}
+
+void ParticipantInterface::add_participants(Participant *participant, const vector<uint64_t> &channels)
+{
+  assert(participant != nullptr);
+  size_t num_channels = channels.size();
+  if (otp_participant_max_channels > 0)
+  {
+    size_t max_channels = (size_t)otp_participant_max_channels;
+    size_t room = max_channels - min(max_channels, participant->m_channels.size());
+    if (num_channels > room)
+    {
+      m_num_rejected_channels += num_channels - room;
+      libotp_cat.warning() << "Participant " << participant->m_channel << " at "
+                           << participant->m_address.get_ip_string() << " hit its limit of "
+                           << otp_participant_max_channels << " channels!" << endl;
+
+      num_channels = room;
+    }
+  }
+
+  if (!num_channels)
   {
     return;
   }
 
-  m_channels_map.insert(pair<uint64_t, Participant*>(channel, participant));
+  // size both tables for the whole batch up front so they rehash at most
+  // once, then add everything with a single lookup per channel
+  m_channels_map.reserve(m_channels_map.size() + num_channels);
+  participant->m_channels.reserve(participant->m_channels.size() + num_channels);
+  for (size_t i = 0; i < num_channels; i++)
+  {
+    uint64_t channel = channels[i];
+    if (channel && m_channels_map.insert(pair<uint64_t, Participant*>(channel, participant)).second)
+    {
+      participant->m_channels.insert(channel);
+    }
+  }
+
+  m_snapshot_dirty = true;
 }
 
 void ParticipantInterface::remove_participant(uint64_t channel)
@@ -199,7 +448,9 @@ void ParticipantInterface::remove_participant(uint64_t channel)
   unordered_map<uint64_t, Participant*>::iterator it;
   it = m_channels_map.find(channel);
   assert(it != m_channels_map.end());
-  m_channels_map.erase(channel);
+  it->second->m_channels.erase(channel);
+  m_channels_map.erase(it);
+  m_snapshot_dirty = true;
 }
 
 void ParticipantInterface::remove_participant(Participant *participant)
@@ -210,7 +461,38 @@ void ParticipantInterface::remove_participant(Participant *participant)
     return;
   }
 
-  remove_participant(participant->m_channel);
+  // drop every channel the participant registered, not just its first one,
+  // so nothing is left pointing at it once it's gone
+  for (uint64_t channel : participant->m_channels)
+  {
+    m_channels_map.erase(channel);
+  }
+
+  participant->m_channels.clear();
+  m_snapshot_dirty = true;
+}
+
+void ParticipantInterface::remove_participants(Participant *participant, const vector<uint64_t> &channels)
+{
+  assert(participant != nullptr);
+  for (uint64_t channel : channels)
+  {
+    if (!channel)
+    {
+      continue;
+    }
+
+    // same as a CONTROL_REMOVE_CHANNEL for each, post removes go first
+    clear_post_removes(participant, channel);
+
+    unordered_map<uint64_t, Participant*>::iterator it = m_channels_map.find(channel);
+    if (it != m_channels_map.end())
+    {
+      it->second->m_channels.erase(channel);
+      m_channels_map.erase(it);
+      m_snapshot_dirty = true;
+    }
+  }
 }
 
 Participant* ParticipantInterface::get_participant(uint64_t channel)
@@ -260,6 +542,42 @@ void ParticipantInterface::add_post_remove(uint64_t channel, PostRemoveHandle *p
     post_removes.push_back(post_remove);
     m_post_removes_map.insert(pair<uint64_t, vector<PostRemoveHandle*>>(channel, post_removes));
   }
+
+  charge_post_remove(post_remove);
+  m_snapshot_dirty = true;
+}
+
+void ParticipantInterface::add_post_removes(Participant *participant, uint64_t channel, const vector<pair<const unsigned char*, size_t>> &datagrams)
+{
+  assert(participant != nullptr);
+  if (datagrams.empty())
+  {
+    return;
+  }
+
+  // one lookup for the whole batch, the handles are all new so there's no
+  // need to check for any of them being filed already
+  vector<PostRemoveHandle*> &post_removes = m_post_removes_map[channel];
+  post_removes.reserve(post_removes.size() + datagrams.size());
+  for (const pair<const unsigned char*, size_t> &datagram : datagrams)
+  {
+    if (!can_add_post_remove(participant, datagram.second))
+    {
+      break;
+    }
+
+    PostRemoveHandle *post_remove = new PostRemoveHandle(channel, new Datagram(datagram.first, datagram.second), participant);
+    post_removes.push_back(post_remove);
+    charge_post_remove(post_remove);
+  }
+
+  if (post_removes.empty())
+  {
+    m_post_removes_map.erase(channel);
+    return;
+  }
+
+  m_snapshot_dirty = true;
 }
 
 void ParticipantInterface::remove_post_remove(uint64_t channel, PostRemoveHandle *post_remove)
@@ -274,15 +592,18 @@ void ParticipantInterface::remove_post_remove(uint64_t channel, PostRemoveHandle
   assert(it != m_post_removes_map.end());
 
   // remove the post remove handle
-  vector<PostRemoveHandle*> post_removes = it->second;
+  vector<PostRemoveHandle*> &post_removes = it->second;
   post_removes.erase(remove(post_removes.begin(), post_removes.end(), post_remove), post_removes.end());
+  release_post_remove(post_remove);
   delete post_remove;
 
   // remove the post removes entry if we have no more handles
   if (!post_removes.size())
   {
-    m_post_removes_map.erase(channel);
+    m_post_removes_map.erase(it);
   }
+
+  m_snapshot_dirty = true;
 }
 
 void ParticipantInterface::clear_post_removes(Participant *participant, uint64_t channel)
@@ -291,12 +612,20 @@ void ParticipantInterface::clear_post_removes(Participant *participant, uint64_t
   it = m_post_removes_map.find(channel);
   if (it != m_post_removes_map.end())
   {
-    for (PostRemoveHandle *post_remove : it->second)
+    // take the handles out of the map first, handling them may well
+    // register or clear post removes on this same channel
+    vector<PostRemoveHandle*> post_removes;
+    post_removes.swap(it->second);
+    m_post_removes_map.erase(it);
+    m_snapshot_dirty = true;
+
+    for (PostRemoveHandle *post_remove : post_removes)
     {
       assert(post_remove != nullptr);
       Datagram dg;
       dg.append_data(post_remove->m_datagram->get_data(), post_remove->m_datagram->get_length());
-      remove_post_remove(channel, post_remove);
+      release_post_remove(post_remove);
+      delete post_remove;
 
       DatagramIterator iterator(dg);
       participant->receive_datagram(iterator);
@@ -311,17 +640,723 @@ void ParticipantInterface::route_datagram(uint64_t channel, uint64_t sender, uin
     return;
   }
 
+  m_profiler.record(channel, sender, message_type, raw_datagram.get_length());
+
   Participant *participant = get_participant(channel);
   if (!participant)
   {
     return;
   }
 
+  if (participant->m_disconnecting)
+  {
+    return;
+  }
+
   Datagram route_dg;
   route_dg.add_uint8(1);
   route_dg.add_uint64(channel);
   route_dg.add_uint64(sender);
   route_dg.add_uint16(message_type);
   route_dg.append_data(raw_datagram.get_data(), raw_datagram.get_length());
+
+  // superseded updates go over the side channel when the participant has
+  // one, anything that doesn't fit there falls back to TCP
+  if (participant->send_unreliable_datagram(route_dg))
+  {
+    return;
+  }
+
+  if (m_messagedirector->m_tracing)
+  {
+    TraceRecord trace = m_messagedirector->m_current_trace;
+    trace.stamp(TRACE_STAGE_ROUTE);
+    participant->m_codec.attach_trace(trace);
+  }
+
   participant->send_datagram(route_dg);
+  check_memory(participant);
+}
+
+void ParticipantInterface::route_message(const MessageHeader &header)
+{
+  // the payload is copied once no matter how many channels it goes to
+  Datagram payload(header.m_payload, header.m_payload_length);
+  if (header.m_num_channels == 1)
+  {
+    route_datagram(header.get_channel(0), header.m_sender, header.m_message_type, payload);
+    return;
+  }
+
+  // a participant subscribed to more than one of the channels still only
+  // gets the message once, addressed to the first channel it matched
+  uint64_t channels[UINT8_MAX];
+  Participant *recipients[UINT8_MAX];
+  size_t num_recipients = 0;
+  header.get_channels(channels);
+  for (uint8_t n = 0; n < header.m_num_channels; n++)
+  {
+    Participant *participant = channels[n] ? get_participant(channels[n]) : nullptr;
+    if (participant != nullptr)
+    {
+      if (find(recipients, recipients + num_recipients, participant) != recipients + num_recipients)
+      {
+        continue;
+      }
+
+      recipients[num_recipients++] = participant;
+    }
+
+    route_datagram(channels[n], header.m_sender, header.m_message_type, payload);
+  }
+}
+
+RouteProfiler* ParticipantInterface::get_route_profiler()
+{
+  return &m_profiler;
+}
+
+size_t ParticipantInterface::get_memory_usage()
+{
+  return m_channels_map.size() * CHANNEL_ENTRY_SIZE + m_post_remove_size;
+}
+
+uint64_t ParticipantInterface::get_num_rejected_channels()
+{
+  return m_num_rejected_channels;
+}
+
+uint64_t ParticipantInterface::get_num_rejected_post_removes()
+{
+  return m_num_rejected_post_removes;
+}
+
+uint64_t ParticipantInterface::get_num_memory_disconnects()
+{
+  return m_num_memory_disconnects;
+}
+
+bool ParticipantInterface::can_add_channel(Participant *participant)
+{
+  assert(participant != nullptr);
+  if (otp_participant_max_channels <= 0 || participant->m_channels.size() < (size_t)otp_participant_max_channels)
+  {
+    return true;
+  }
+
+  m_num_rejected_channels++;
+  libotp_cat.warning() << "Participant " << participant->m_channel << " at "
+                       << participant->m_address.get_ip_string() << " hit its limit of "
+                       << otp_participant_max_channels << " channels!" << endl;
+
+  return false;
+}
+
+bool ParticipantInterface::can_add_post_remove(Participant *participant, size_t length)
+{
+  assert(participant != nullptr);
+  if (otp_participant_max_post_remove_size <= 0 ||
+      participant->m_post_remove_size + length <= (size_t)otp_participant_max_post_remove_size)
+  {
+    return true;
+  }
+
+  m_num_rejected_post_removes++;
+  libotp_cat.warning() << "Participant " << participant->m_channel << " at "
+                       << participant->m_address.get_ip_string() << " hit its limit of "
+                       << otp_participant_max_post_remove_size << " bytes of post removes!" << endl;
+
+  return false;
+}
+
+bool ParticipantInterface::check_memory(Participant *participant)
+{
+  assert(participant != nullptr);
+
+  // in-process participants have no connection to drop and nothing
+  // buffered on their behalf
+  if (participant->m_connection == nullptr)
+  {
+    return true;
+  }
+
+  if (otp_participant_max_memory <= 0 || participant->m_disconnecting)
+  {
+    return !participant->m_disconnecting;
+  }
+
+  size_t usage = participant->get_memory_usage();
+  if (usage <= (size_t)otp_participant_max_memory)
+  {
+    return true;
+  }
+
+  libotp_cat.warning() << "Disconnecting participant " << participant->m_channel << " at "
+                       << participant->m_address.get_ip_string() << " for holding "
+                       << usage << " bytes, over its limit of " << otp_participant_max_memory << "!" << endl;
+
+  m_num_memory_disconnects++;
+  m_messagedirector->request_disconnect(participant);
+  return false;
+}
+
+void ParticipantInterface::charge_post_remove(PostRemoveHandle *post_remove)
+{
+  assert(post_remove != nullptr);
+  size_t size = post_remove->get_size();
+  m_post_remove_size += size;
+  Participant *participant = post_remove->m_participant;
+  if (participant != nullptr)
+  {
+    post_remove->m_participant_index = participant->m_post_removes.size();
+    participant->m_post_removes.push_back(post_remove);
+    participant->m_post_remove_size += size;
+  }
+}
+
+void ParticipantInterface::release_post_remove(PostRemoveHandle *post_remove)
+{
+  assert(post_remove != nullptr);
+  size_t size = post_remove->get_size();
+  m_post_remove_size -= size;
+  Participant *participant = post_remove->m_participant;
+  if (participant != nullptr)
+  {
+    // swap the last handle into its slot so releasing one is constant time
+    PostRemoveHandle *last = participant->m_post_removes.back();
+    participant->m_post_removes[post_remove->m_participant_index] = last;
+    last->m_participant_index = post_remove->m_participant_index;
+    participant->m_post_removes.pop_back();
+
+    participant->m_post_remove_size -= size;
+    post_remove->m_participant = nullptr;
+  }
+}
+
+void ParticipantInterface::disown_post_removes(Participant *participant)
+{
+  assert(participant != nullptr);
+  // post removes filed under channels other than the participant's own
+  // outlive it, they just aren't charged to anyone anymore
+  for (PostRemoveHandle *post_remove : participant->m_post_removes)
+  {
+    post_remove->m_participant = nullptr;
+  }
+
+  participant->m_post_removes.clear();
+  participant->m_post_remove_size = 0;
+}
+
+bool ParticipantInterface::has_message_handler(uint16_t message_type)
+{
+  if (m_message_handlers.empty())
+  {
+    return false;
+  }
+
+  return m_message_handlers[message_type].m_handler != nullptr;
+}
+
+void ParticipantInterface::set_message_handler(uint16_t message_type, MessageHandler handler, void *data)
+{
+  set_message_handler_range(message_type, message_type, handler, data);
+}
+
+void ParticipantInterface::set_message_handler_range(uint16_t lo_message_type, uint16_t hi_message_type, MessageHandler handler, void *data)
+{
+  assert(handler != nullptr);
+  assert(lo_message_type <= hi_message_type);
+  if (m_message_handlers.empty())
+  {
+    m_message_handlers.resize(UINT16_MAX + 1);
+  }
+
+  for (uint32_t message_type = lo_message_type; message_type <= hi_message_type; message_type++)
+  {
+    MessageHandlerEntry &entry = m_message_handlers[message_type];
+    entry.m_handler = handler;
+    entry.m_data = data;
+  }
+}
+
+void ParticipantInterface::clear_message_handler(uint16_t message_type)
+{
+  clear_message_handler_range(message_type, message_type);
+}
+
+void ParticipantInterface::clear_message_handler_range(uint16_t lo_message_type, uint16_t hi_message_type)
+{
+  if (m_message_handlers.empty())
+  {
+    return;
+  }
+
+  for (uint32_t message_type = lo_message_type; message_type <= hi_message_type; message_type++)
+  {
+    MessageHandlerEntry &entry = m_message_handlers[message_type];
+    entry.m_handler = nullptr;
+    entry.m_data = nullptr;
+  }
+}
+
+bool ParticipantInterface::dispatch_message(Participant *participant, uint64_t channel, uint64_t sender, uint16_t message_type, DatagramIterator &iterator)
+{
+  if (m_message_handlers.empty())
+  {
+    return false;
+  }
+
+  const MessageHandlerEntry &entry = m_message_handlers[message_type];
+  if (!entry.m_handler)
+  {
+    return false;
+  }
+
+  // give the handler its own iterator so a declined message can still be
+  // routed from the start of its payload
+  DatagramIterator handler_iterator(iterator);
+  return entry.m_handler(participant, channel, sender, message_type, handler_iterator, entry.m_data);
+}
+
+void ParticipantInterface::load_snapshot()
+{
+  string path = otp_snapshot_path;
+  TrueClock *clock = TrueClock::get_global_ptr();
+  double start = clock->get_short_time();
+
+  // map the whole snapshot in and restore it in one pass
+#ifdef _WIN32
+  ifstream file(path.c_str(), ios::in | ios::binary);
+  if (!file)
+  {
+    return;
+  }
+
+  vector<unsigned char> buffer((istreambuf_iterator<char>(file)), istreambuf_iterator<char>());
+  const unsigned char *data = buffer.data();
+  size_t size = buffer.size();
+#else
+  int fd = open(path.c_str(), O_RDONLY);
+  if (fd < 0)
+  {
+    return;
+  }
+
+  struct stat info;
+  if (fstat(fd, &info) < 0 || info.st_size <= 0)
+  {
+    close(fd);
+    return;
+  }
+
+  size_t size = (size_t)info.st_size;
+  void *mapping = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (mapping == MAP_FAILED)
+  {
+    libotp_cat.warning() << "Failed to map routing snapshot " << path << "!" << endl;
+    return;
+  }
+
+  madvise(mapping, size, MADV_SEQUENTIAL);
+  const unsigned char *data = (const unsigned char*)mapping;
+#endif
+
+  size_t offset = 16;
+  bool valid = size >= offset && load_uint32(data) == SNAPSHOT_MAGIC && load_uint32(data + 4) == SNAPSHOT_VERSION;
+  if (valid)
+  {
+    uint32_t num_channels = load_uint32(data + 8);
+    uint32_t num_post_removes = load_uint32(data + 12);
+    if ((size - offset) / 16 < num_channels)
+    {
+      valid = false;
+    }
+    else
+    {
+      for (uint32_t i = 0; i < num_channels; i++, offset += 16)
+      {
+        uint64_t channel = load_uint64(data + offset);
+        uint64_t owner = load_uint64(data + offset + 8);
+        m_restored_channels_map[owner].push_back(channel);
+      }
+
+      m_num_restored_channels = num_channels;
+    }
+
+    for (uint32_t i = 0; valid && i < num_post_removes; i++)
+    {
+      if (size - offset < 12 || size - offset - 12 < load_uint32(data + offset + 8))
+      {
+        valid = false;
+        break;
+      }
+
+      uint64_t channel = load_uint64(data + offset);
+      uint32_t length = load_uint32(data + offset + 8);
+      m_restored_post_removes_map[channel].push_back(Datagram(data + offset + 12, length));
+      offset += 12 + length;
+    }
+  }
+
+#ifndef _WIN32
+  munmap(mapping, size);
+#endif
+
+  if (!valid)
+  {
+    libotp_cat.warning() << "Ignoring invalid routing snapshot " << path << "!" << endl;
+    m_restored_channels_map.clear();
+    m_restored_post_removes_map.clear();
+    m_num_restored_channels = 0;
+    return;
+  }
+
+  m_snapshot_load_time = clock->get_short_time() - start;
+  m_snapshot_expire_time = clock->get_short_time() + otp_snapshot_grace;
+
+  libotp_cat.info() << "Restored " << m_num_restored_channels << " channels for "
+                    << m_restored_channels_map.size() << " participants from "
+                    << path << " in " << m_snapshot_load_time << " seconds." << endl;
+}
+
+bool ParticipantInterface::write_snapshot()
+{
+  if (otp_snapshot_path.get_value().empty())
+  {
+    return false;
+  }
+
+  // let any write already under way finish first, then take the whole
+  // capture in one go
+  if (m_snapshot_thread.joinable())
+  {
+    m_snapshot_thread.join();
+  }
+
+  m_snapshot_failed = false;
+  begin_capture();
+  advance_capture(SIZE_MAX);
+  m_capturing = false;
+
+  SnapshotCapture capture;
+  swap(capture, m_capture);
+  if (!write_snapshot_file(capture))
+  {
+    m_snapshot_dirty = true;
+    return false;
+  }
+
+  return true;
+}
+
+void ParticipantInterface::begin_capture()
+{
+  m_capture = SnapshotCapture();
+  m_capture.m_path = otp_snapshot_path;
+  m_capture.m_num_channel_buckets = m_channels_map.bucket_count();
+  m_capture.m_num_post_remove_buckets = m_post_removes_map.bucket_count();
+  m_capture.m_channels.reserve(m_channels_map.size() + m_num_restored_channels);
+
+  // channels we've restored but that haven't been claimed yet are written
+  // back out too, so a second restart during the grace period loses nothing
+  unordered_map<uint64_t, vector<uint64_t>>::iterator rit = m_restored_channels_map.begin();
+  for (; rit != m_restored_channels_map.end(); ++rit)
+  {
+    for (uint64_t channel : rit->second)
+    {
+      m_capture.m_channels.push_back(pair<uint64_t, uint64_t>(channel, rit->first));
+    }
+  }
+
+  unordered_map<uint64_t, vector<Datagram>>::iterator rpit = m_restored_post_removes_map.begin();
+  for (; rpit != m_restored_post_removes_map.end(); ++rpit)
+  {
+    for (const Datagram &datagram : rpit->second)
+    {
+      m_capture.m_post_removes.push_back(pair<uint64_t, string>(rpit->first, datagram.get_message()));
+    }
+  }
+
+  // anything that changes from here on makes the next snapshot
+  m_capturing = true;
+  m_snapshot_dirty = false;
+}
+
+bool ParticipantInterface::advance_capture(size_t max_buckets)
+{
+  // a rehash shuffles entries between buckets, so the buckets we've
+  // already walked mean nothing anymore and we start over
+  if (m_channels_map.bucket_count() != m_capture.m_num_channel_buckets ||
+      m_post_removes_map.bucket_count() != m_capture.m_num_post_remove_buckets)
+  {
+    begin_capture();
+  }
+
+  size_t num_buckets = 0;
+  for (; m_capture.m_channel_bucket < m_capture.m_num_channel_buckets && num_buckets < max_buckets; num_buckets++)
+  {
+    size_t bucket = m_capture.m_channel_bucket++;
+    unordered_map<uint64_t, Participant*>::local_iterator it = m_channels_map.begin(bucket);
+    for (; it != m_channels_map.end(bucket); ++it)
+    {
+      m_capture.m_channels.push_back(pair<uint64_t, uint64_t>(it->first, it->second->m_channel));
+    }
+  }
+
+  for (; m_capture.m_post_remove_bucket < m_capture.m_num_post_remove_buckets && num_buckets < max_buckets; num_buckets++)
+  {
+    size_t bucket = m_capture.m_post_remove_bucket++;
+    unordered_map<uint64_t, vector<PostRemoveHandle*>>::local_iterator it = m_post_removes_map.begin(bucket);
+    for (; it != m_post_removes_map.end(bucket); ++it)
+    {
+      for (PostRemoveHandle *post_remove : it->second)
+      {
+        m_capture.m_post_removes.push_back(pair<uint64_t, string>(it->first, post_remove->m_datagram->get_message()));
+      }
+    }
+  }
+
+  return m_capture.m_channel_bucket >= m_capture.m_num_channel_buckets &&
+         m_capture.m_post_remove_bucket >= m_capture.m_num_post_remove_buckets;
+}
+
+bool ParticipantInterface::write_snapshot_file(const SnapshotCapture &capture)
+{
+  Datagram snapshot;
+  snapshot.add_uint32(SNAPSHOT_MAGIC);
+  snapshot.add_uint32(SNAPSHOT_VERSION);
+  snapshot.add_uint32((uint32_t)capture.m_channels.size());
+  snapshot.add_uint32((uint32_t)capture.m_post_removes.size());
+
+  for (const pair<uint64_t, uint64_t> &channel : capture.m_channels)
+  {
+    snapshot.add_uint64(channel.first);
+    snapshot.add_uint64(channel.second);
+  }
+
+  for (const pair<uint64_t, string> &post_remove : capture.m_post_removes)
+  {
+    snapshot.add_uint64(post_remove.first);
+    snapshot.add_uint32((uint32_t)post_remove.second.size());
+    snapshot.append_data(post_remove.second.data(), post_remove.second.size());
+  }
+
+  // write to the side and swap it in, so a crash mid write never leaves us
+  // with a torn snapshot
+  const string &path = capture.m_path;
+  string temp_path = path + ".tmp";
+#ifdef _WIN32
+  {
+    ofstream file(temp_path.c_str(), ios::out | ios::binary | ios::trunc);
+    if (!file || !file.write((const char*)snapshot.get_data(), snapshot.get_length()))
+    {
+      libotp_cat.warning() << "Failed to write routing snapshot " << temp_path << "!" << endl;
+      return false;
+    }
+  }
+
+  remove(path.c_str());
+#else
+  int fd = open(temp_path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (fd < 0)
+  {
+    libotp_cat.warning() << "Failed to open routing snapshot " << temp_path << "!" << endl;
+    return false;
+  }
+
+  const char *data = (const char*)snapshot.get_data();
+  size_t remaining = snapshot.get_length();
+  while (remaining > 0)
+  {
+    ssize_t written = write(fd, data, remaining);
+    if (written <= 0)
+    {
+      libotp_cat.warning() << "Failed to write routing snapshot " << temp_path << "!" << endl;
+      close(fd);
+      return false;
+    }
+
+    data += written;
+    remaining -= written;
+  }
+
+  close(fd);
+#endif
+
+  if (rename(temp_path.c_str(), path.c_str()) != 0)
+  {
+    libotp_cat.warning() << "Failed to replace routing snapshot " << path << "!" << endl;
+    return false;
+  }
+
+  return true;
+}
+
+void ParticipantInterface::snapshot_thread(ParticipantInterface *self, SnapshotCapture *capture)
+{
+  if (!write_snapshot_file(*capture))
+  {
+    self->m_snapshot_failed = true;
+  }
+
+  delete capture;
+  self->m_snapshot_writing = false;
+}
+
+size_t ParticipantInterface::get_num_restored_channels()
+{
+  return m_num_restored_channels;
+}
+
+double ParticipantInterface::get_snapshot_load_time()
+{
+  return m_snapshot_load_time;
+}
+
+void ParticipantInterface::claim_snapshot(Participant *participant)
+{
+  assert(participant != nullptr);
+  unordered_map<uint64_t, vector<uint64_t>>::iterator it;
+  it = m_restored_channels_map.find(participant->m_channel);
+  if (it == m_restored_channels_map.end())
+  {
+    return;
+  }
+
+  vector<uint64_t> channels;
+  channels.swap(it->second);
+  m_restored_channels_map.erase(it);
+
+  for (uint64_t channel : channels)
+  {
+    add_participant(channel, participant);
+
+    unordered_map<uint64_t, vector<Datagram>>::iterator pit;
+    pit = m_restored_post_removes_map.find(channel);
+    if (pit == m_restored_post_removes_map.end())
+    {
+      continue;
+    }
+
+    for (const Datagram &datagram : pit->second)
+    {
+      PostRemoveHandle *post_remove = new PostRemoveHandle(channel, new Datagram(datagram), participant);
+      post_remove->m_restored = true;
+      add_post_remove(channel, post_remove);
+    }
+
+    m_restored_post_removes_map.erase(pit);
+  }
+}
+
+void ParticipantInterface::expire_snapshot()
+{
+  // whoever hasn't come back by now isn't going to, so their post removes
+  // go out just as if they had disconnected from us
+  unordered_map<uint64_t, vector<Datagram>>::iterator it = m_restored_post_removes_map.begin();
+  for (; it != m_restored_post_removes_map.end(); ++it)
+  {
+    for (const Datagram &datagram : it->second)
+    {
+      route_post_remove(datagram);
+    }
+  }
+
+  if (!m_restored_channels_map.empty() || !m_restored_post_removes_map.empty())
+  {
+    m_snapshot_dirty = true;
+  }
+
+  m_restored_channels_map.clear();
+  m_restored_post_removes_map.clear();
+}
+
+void ParticipantInterface::drop_restored_post_removes(uint64_t channel)
+{
+  unordered_map<uint64_t, vector<PostRemoveHandle*>>::iterator it;
+  it = m_post_removes_map.find(channel);
+  if (it == m_post_removes_map.end())
+  {
+    return;
+  }
+
+  vector<PostRemoveHandle*> &post_removes = it->second;
+  vector<PostRemoveHandle*>::iterator last = post_removes.begin();
+  for (PostRemoveHandle *post_remove : post_removes)
+  {
+    if (!post_remove->m_restored)
+    {
+      *last++ = post_remove;
+      continue;
+    }
+
+    release_post_remove(post_remove);
+    delete post_remove;
+    m_snapshot_dirty = true;
+  }
+
+  post_removes.erase(last, post_removes.end());
+  if (post_removes.empty())
+  {
+    m_post_removes_map.erase(it);
+  }
+}
+
+void ParticipantInterface::route_post_remove(const Datagram &datagram)
+{
+  MessageHeader header;
+  if (!header.parse(datagram.get_data(), datagram.get_length()) || header.m_control)
+  {
+    return;
+  }
+
+  route_message(header);
+}
+
+AsyncTask::DoneStatus ParticipantInterface::snapshot_poll(GenericAsyncTask *task, void *data)
+{
+  ParticipantInterface *self = (ParticipantInterface*)data;
+  double now = TrueClock::get_global_ptr()->get_short_time();
+  if (!self->m_restored_channels_map.empty() || !self->m_restored_post_removes_map.empty())
+  {
+    if (now >= self->m_snapshot_expire_time)
+    {
+      self->expire_snapshot();
+    }
+  }
+
+  if (self->m_snapshot_failed.exchange(false))
+  {
+    self->m_snapshot_dirty = true;
+  }
+
+  // the copy is taken a few buckets a frame so a big routing table never
+  // stalls us, only the last write is allowed to be in flight at a time
+  if (!self->m_capturing)
+  {
+    if (!self->m_snapshot_dirty || self->m_snapshot_writing)
+    {
+      return AsyncTask::DS_again;
+    }
+
+    self->begin_capture();
+  }
+
+  if (!self->advance_capture(max(otp_snapshot_batch_size.get_value(), 1)))
+  {
+    return AsyncTask::DS_cont;
+  }
+
+  self->m_capturing = false;
+  if (self->m_snapshot_thread.joinable())
+  {
+    self->m_snapshot_thread.join();
+  }
+
+  SnapshotCapture *capture = new SnapshotCapture();
+  swap(*capture, self->m_capture);
+  self->m_snapshot_writing = true;
+  self->m_snapshot_thread = thread(&ParticipantInterface::snapshot_thread, self, capture);
+  return AsyncTask::DS_again;
 }
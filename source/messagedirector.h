@@ -30,23 +30,47 @@
 #include <vector>
 #include <deque>
 #include <unordered_map>
+#include <unordered_set>
+#include <string>
+#include <atomic>
+#include <thread>
 
 #include "pandabase.h"
 #include "netAddress.h"
 #include "connection.h"
+#include "deletedChain.h"
 
 #include "datagram.h"
 #include "datagramIterator.h"
 
 #include "msgtypes.h"
 #include "network.h"
+#include "profiler.h"
+#include "messageheader.h"
 
+class Participant;
 class MessageDirector;
 class PostRemoveHandle;
 class ParticipantInterface;
 
+// A native handler bound to a message type in the ParticipantInterface
+// dispatch table. The iterator is positioned at the start of the payload,
+// returning false hands the message back to the default routing.
+typedef bool (*MessageHandler)(Participant *participant, uint64_t channel, uint64_t sender, uint16_t message_type, DatagramIterator &iterator, void *data);
+
+// What one registered channel costs us, a node in the routing table and
+// one in the participant's own channel set, plus their bucket slots.
+#define CHANNEL_ENTRY_SIZE (sizeof(pair<const uint64_t, Participant*>) + sizeof(uint64_t) + 4 * sizeof(void*))
+
 class Participant : public NetworkHandler
 {
+public:
+  // participants come and go in storms when everyone reconnects at once,
+  // keep their memory on a free list instead of going back to the heap.
+  // a chain only hands out blocks of its own class's size, so a subclass
+  // has to declare its own chain as LocalParticipant does.
+  ALLOC_DELETED_CHAIN(Participant);
+
 PUBLISHED:
   Participant(MessageDirector *acceptor, ParticipantInterface *interface, PT(Connection) rendezvous, NetAddress address, PT(Connection) connection);
   ~Participant();
@@ -54,21 +78,34 @@ PUBLISHED:
   void receive_datagram(DatagramIterator &iterator);
   void disconnected();
 
+  size_t get_num_channels();
+  size_t get_num_post_removes();
+  size_t get_post_remove_size();
+  size_t get_memory_usage();
+
 public:
   ParticipantInterface *m_interface = nullptr;
+  unordered_set<uint64_t> m_channels;
   uint64_t m_channel = 0;
   uint64_t m_lo_channel = 0;
   uint64_t m_hi_channel = 0;
+
+  // post removes this participant registered, wherever they're filed
+  vector<PostRemoveHandle*> m_post_removes;
+  size_t m_post_remove_size = 0;
 };
 
 class MessageDirector : public NetworkAcceptor
 {
 PUBLISHED:
-  MessageDirector(const char *address, uint16_t port, uint32_t backlog=100000, size_t num_threads=1);
+  MessageDirector(const char *address, uint16_t port, uint32_t backlog=100000, size_t num_threads=1,
+                  uint8_t backend=NETWORK_BACKEND_DEFAULT);
   ~MessageDirector();
 
   Participant* init_handler(PT(Connection) rendezvous, NetAddress address, PT(Connection) connection);
 
+  ParticipantInterface* get_interface();
+
 public:
   ParticipantInterface *m_interface = nullptr;
 };
@@ -76,12 +113,46 @@ public:
 class PostRemoveHandle
 {
 public:
-  PostRemoveHandle(uint64_t m_sender, Datagram *datagram);
+  PostRemoveHandle(uint64_t m_sender, Datagram *datagram, Participant *participant=nullptr);
   ~PostRemoveHandle();
 
+  size_t get_size() const;
+
 public:
   uint64_t m_sender = 0;
   Datagram *m_datagram;
+
+  // whoever the handle is charged to, cleared if they leave it behind,
+  // and where it sits in their list of post removes
+  Participant *m_participant = nullptr;
+  size_t m_participant_index = 0;
+
+  // restored from a snapshot rather than registered since we started
+  bool m_restored = false;
+};
+
+// A copy of the routing state taken a few buckets at a time on the routing
+// thread, then written out by a background thread. Entries that change
+// while the capture is in progress may or may not make it in, the snapshot
+// is marked dirty again so the next one picks them up.
+class SnapshotCapture
+{
+public:
+  string m_path;
+  vector<pair<uint64_t, uint64_t>> m_channels;
+  vector<pair<uint64_t, string>> m_post_removes;
+
+  size_t m_channel_bucket = 0;
+  size_t m_num_channel_buckets = 0;
+  size_t m_post_remove_bucket = 0;
+  size_t m_num_post_remove_buckets = 0;
+};
+
+class MessageHandlerEntry
+{
+public:
+  MessageHandler m_handler = nullptr;
+  void *m_data = nullptr;
 };
 
 class ParticipantInterface : public TypedObject
@@ -107,11 +178,83 @@ PUBLISHED:
 
   void route_datagram(uint64_t channel, uint64_t sender, uint16_t message_type, Datagram &raw_datagram);
 
+  bool write_snapshot();
+  size_t get_num_restored_channels();
+  double get_snapshot_load_time();
+
+  RouteProfiler* get_route_profiler();
+
+  size_t get_memory_usage();
+  uint64_t get_num_rejected_channels();
+  uint64_t get_num_rejected_post_removes();
+  uint64_t get_num_memory_disconnects();
+
+  bool has_message_handler(uint16_t message_type);
+  void clear_message_handler(uint16_t message_type);
+  void clear_message_handler_range(uint16_t lo_message_type, uint16_t hi_message_type);
+
+public:
+  void set_message_handler(uint16_t message_type, MessageHandler handler, void *data=nullptr);
+  void set_message_handler_range(uint16_t lo_message_type, uint16_t hi_message_type, MessageHandler handler, void *data=nullptr);
+  bool dispatch_message(Participant *participant, uint64_t channel, uint64_t sender, uint16_t message_type, DatagramIterator &iterator);
+  void route_message(const MessageHeader &header);
+
+  void add_participants(Participant *participant, const vector<uint64_t> &channels);
+  void remove_participants(Participant *participant, const vector<uint64_t> &channels);
+
+  bool can_add_channel(Participant *participant);
+  bool can_add_post_remove(Participant *participant, size_t length);
+  bool check_memory(Participant *participant);
+  void add_post_removes(Participant *participant, uint64_t channel, const vector<pair<const unsigned char*, size_t>> &datagrams);
+  void charge_post_remove(PostRemoveHandle *post_remove);
+  void release_post_remove(PostRemoveHandle *post_remove);
+  void disown_post_removes(Participant *participant);
+
+  void load_snapshot();
+  void claim_snapshot(Participant *participant);
+  void expire_snapshot();
+  void route_post_remove(const Datagram &datagram);
+  void drop_restored_post_removes(uint64_t channel);
+
+  void begin_capture();
+  bool advance_capture(size_t max_buckets);
+  static bool write_snapshot_file(const SnapshotCapture &capture);
+
+private:
+  static AsyncTask::DoneStatus snapshot_poll(GenericAsyncTask *task, void *data);
+  static void snapshot_thread(ParticipantInterface *self, SnapshotCapture *capture);
+
 public:
   MessageDirector *m_messagedirector = nullptr;
   unordered_map<uint64_t, Participant*> m_channels_map;
   unordered_map<uint64_t, vector<PostRemoveHandle*>> m_post_removes_map;
 
+  // indexed directly by message type, sized on the first registration
+  vector<MessageHandlerEntry> m_message_handlers;
+
+  RouteProfiler m_profiler;
+
+  size_t m_post_remove_size = 0;
+  uint64_t m_num_rejected_channels = 0;
+  uint64_t m_num_rejected_post_removes = 0;
+  uint64_t m_num_memory_disconnects = 0;
+
+  // routing state restored from a snapshot that hasn't been claimed yet,
+  // channels are grouped by the channel their participant registered first
+  unordered_map<uint64_t, vector<uint64_t>> m_restored_channels_map;
+  unordered_map<uint64_t, vector<Datagram>> m_restored_post_removes_map;
+  size_t m_num_restored_channels = 0;
+  double m_snapshot_load_time = 0.0;
+  double m_snapshot_expire_time = 0.0;
+  bool m_snapshot_dirty = false;
+  PT(GenericAsyncTask) m_snapshot_task;
+
+  SnapshotCapture m_capture;
+  bool m_capturing = false;
+  thread m_snapshot_thread;
+  atomic<bool> m_snapshot_writing;
+  atomic<bool> m_snapshot_failed;
+
 public:
   static TypeHandle get_class_type()
   {
@@ -0,0 +1,148 @@
+// Copyright (c) 2019, Caleb Marshall.
+//
+// This file is part of Toontown OTP.
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+//
+// You should have received a copy of the MIT License
+// along with Toontown OTP. If not, see <https://opensource.org/licenses/MIT>.
+
+#pragma once
+
+#include <stdint.h>
+#include <string.h>
+
+#include "pandabase.h"
+
+#include "msgtypes.h"
+
+// Little endian loads straight out of a wire buffer, which makes no
+// alignment promises.
+inline uint16_t load_uint16(const unsigned char *bytes)
+{
+#ifdef WORDS_BIGENDIAN
+  return (uint16_t)(bytes[0] | (bytes[1] << 8));
+#else
+  uint16_t value;
+  memcpy(&value, bytes, sizeof(value));
+  return value;
+#endif
+}
+
+inline uint32_t load_uint32(const unsigned char *bytes)
+{
+#ifdef WORDS_BIGENDIAN
+  return (uint32_t)bytes[0] | ((uint32_t)bytes[1] << 8) | ((uint32_t)bytes[2] << 16) | ((uint32_t)bytes[3] << 24);
+#else
+  uint32_t value;
+  memcpy(&value, bytes, sizeof(value));
+  return value;
+#endif
+}
+
+inline uint64_t load_uint64(const unsigned char *bytes)
+{
+#ifdef WORDS_BIGENDIAN
+  uint64_t value = 0;
+  for (int i = 7; i >= 0; i--)
+  {
+    value = (value << 8) | bytes[i];
+  }
+
+  return value;
+#else
+  uint64_t value;
+  memcpy(&value, bytes, sizeof(value));
+  return value;
+#endif
+}
+
+// A view over the header of a message in the message director's wire
+// format, the channel count, the channels, the sender and the message type.
+// Control messages carry their type before the sender. The whole header
+// is length checked once up front, so a truncated message is turned away
+// instead of tripping an assert halfway through, and nothing is copied
+// until the payload is actually needed.
+class MessageHeader
+{
+public:
+  bool parse(const void *data, size_t length)
+  {
+    const unsigned char *bytes = (const unsigned char*)data;
+    if (length < 1 || bytes[0] == 0)
+    {
+      return false;
+    }
+
+    m_num_channels = bytes[0];
+    m_header_length = 1 + (size_t)m_num_channels * sizeof(uint64_t) + sizeof(uint64_t) + sizeof(uint16_t);
+    if (length < m_header_length)
+    {
+      return false;
+    }
+
+    m_channels = bytes + 1;
+    const unsigned char *tail = m_channels + (size_t)m_num_channels * sizeof(uint64_t);
+    m_control = m_num_channels == 1 && load_uint64(m_channels) == CONTROL_MESSAGE;
+    if (m_control)
+    {
+      m_message_type = load_uint16(tail);
+      m_sender = load_uint64(tail + sizeof(uint16_t));
+    }
+    else
+    {
+      m_sender = load_uint64(tail);
+      m_message_type = load_uint16(tail + sizeof(uint64_t));
+    }
+
+    m_payload = bytes + m_header_length;
+    m_payload_length = length - m_header_length;
+    return true;
+  }
+
+  uint64_t get_channel(size_t n) const
+  {
+    return load_uint64(m_channels + n * sizeof(uint64_t));
+  }
+
+  // copies out the whole channel list, which on a little endian host is a
+  // single block copy the compiler turns into wide moves
+  void get_channels(uint64_t *channels) const
+  {
+#ifdef WORDS_BIGENDIAN
+    for (size_t n = 0; n < m_num_channels; n++)
+    {
+      channels[n] = get_channel(n);
+    }
+#else
+    memcpy(channels, m_channels, (size_t)m_num_channels * sizeof(uint64_t));
+#endif
+  }
+
+public:
+  bool m_control = false;
+  uint8_t m_num_channels = 0;
+  const unsigned char *m_channels = nullptr;
+  uint64_t m_sender = 0;
+  uint16_t m_message_type = 0;
+
+  size_t m_header_length = 0;
+  const unsigned char *m_payload = nullptr;
+  size_t m_payload_length = 0;
+};
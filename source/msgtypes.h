@@ -34,3 +34,24 @@
 #define CONTROL_REMOVE_RANGE       2007
 #define CONTROL_ADD_POST_REMOVE    2008
 #define CONTROL_CLEAR_POST_REMOVE  2009
+#define CONTROL_SET_LINK_OPTIONS   2010
+#define CONTROL_SET_UDP_ENDPOINT   2011
+#define CONTROL_ADD_CHANNELS       2012
+#define CONTROL_REMOVE_CHANNELS    2013
+#define CONTROL_ADD_POST_REMOVES   2014
+
+#define LINK_OPTION_COMPRESSION    0x01
+#define LINK_OPTION_TRACING        0x02
+#define LINK_OPTION_FRAGMENTATION  0x04
+
+#define LINK_FRAME_FRAGMENT        0xfc
+#define LINK_FRAME_TRACE           0xfd
+#define LINK_FRAME_RAW             0xfe
+#define LINK_FRAME_ZLIB            0xff
+
+// a fragment frame is the marker, a uint32 message id and the uint32 length
+// of the whole message, followed by the next chunk of it
+#define LINK_FRAGMENT_HEADER_SIZE  9
+
+// the lowest frame marker, frames starting below it are plain messages
+#define LINK_FRAME_MARKER          LINK_FRAME_FRAGMENT
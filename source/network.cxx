@@ -24,6 +24,20 @@
 // along with Toontown OTP. If not, see <https://opensource.org/licenses/MIT>.
 
 #include "network.h"
+#include "iouring.h"
+#include "msgtypes.h"
+#include "config_libotp.h"
+#include "messageheader.h"
+
+#include <random>
+#include <sstream>
+
+#ifdef __linux__
+#include <errno.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#endif
 
 TypeHandle NetworkConnector::_type_handle;
 TypeHandle NetworkHandler::_type_handle;
@@ -31,276 +45,2620 @@ TypeHandle NetworkAcceptor::_type_handle;
 
 PT(AsyncTaskManager) task_mgr = AsyncTaskManager::get_global_ptr();
 
-NetworkConnector::NetworkConnector(const char *address, uint16_t port, int timeout_ms, size_t num_threads)
-  : m_address(address), m_port(port), m_timeout_ms(timeout_ms),
-    m_reader(&m_manager, num_threads), m_writer(&m_manager, num_threads)
+// Returns the io_uring backend to use, or nullptr to stay on Panda's
+// connection reader and writer.
+static IoUringBackend* open_io_uring(uint8_t backend, int tcp_header_size)
 {
-  // setup our connection
-  setup_connection();
+  if (backend == NETWORK_BACKEND_DEFAULT)
+  {
+    backend = otp_io_uring ? NETWORK_BACKEND_IO_URING : NETWORK_BACKEND_PANDA;
+  }
+
+  if (backend != NETWORK_BACKEND_IO_URING)
+  {
+    return nullptr;
+  }
+
+  IoUringBackend *uring = new IoUringBackend(tcp_header_size);
+  if (!uring->is_valid())
+  {
+    libotp_cat.warning() << "io_uring is not available, falling back to the default network backend!" << endl;
+    delete uring;
+    return nullptr;
+  }
+
+  return uring;
+}
+
+#ifdef __linux__
+static Socket_Address get_socket_address(const struct sockaddr_storage &addr)
+{
+  if (addr.ss_family == AF_INET6)
+  {
+    return Socket_Address(*(const struct sockaddr_in6*)&addr);
+  }
+
+  return Socket_Address(*(const struct sockaddr_in*)&addr);
+}
+#endif
+
+bool pack_datagram(Datagram &packed, LinkCodec *codec, const void *data, size_t length, int header_size)
+{
+  Datagram encoded;
+  if (codec != nullptr && codec->encode(data, length, encoded))
+  {
+    data = encoded.get_data();
+    length = encoded.get_length();
+  }
+
+  switch (header_size)
+  {
+    case 0:
+      break;
+    case 2:
+      if (length > 0xffff)
+      {
+        return false;
+      }
+
+      packed.add_uint16((uint16_t)length);
+      break;
+    case 4:
+      if (length > 0xffffffff)
+      {
+        return false;
+      }
+
+      packed.add_uint32((uint32_t)length);
+      break;
+    default:
+      return false;
+  }
+
+  packed.append_data(data, length);
+  return true;
+}
+
+bool repack_datagrams(Datagram &packed, LinkCodec *codec, const Datagram &source, int header_size, uint8_t *lane)
+{
+  // the source buffer holds messages prefixed with a little endian uint16
+  // length, which is exactly what Datagram.add_blob writes from Python
+  const unsigned char *data = (const unsigned char*)source.get_data();
+  size_t length = source.get_length();
+  size_t offset = 0;
+  while (offset < length)
+  {
+    if (length - offset < 2)
+    {
+      return false;
+    }
+
+    size_t size = (size_t)data[offset] | ((size_t)data[offset + 1] << 8);
+    offset += 2;
+    if (length - offset < size)
+    {
+      return false;
+    }
+
+    if (!pack_datagram(packed, codec, data + offset, size, header_size))
+    {
+      return false;
+    }
+
+    if (lane != nullptr)
+    {
+      *lane = min(*lane, get_datagram_lane(data + offset, size));
+    }
+
+    offset += size;
+  }
+
+  return true;
+}
+
+bool unpack_datagrams(vector<Datagram> &datagrams, const Datagram &source)
+{
+  const unsigned char *data = (const unsigned char*)source.get_data();
+  size_t length = source.get_length();
+  size_t offset = 0;
+  while (offset < length)
+  {
+    if (length - offset < 2 || length - offset - 2 < load_uint16(data + offset))
+    {
+      return false;
+    }
+
+    size_t size = load_uint16(data + offset);
+    datagrams.push_back(Datagram(data + offset + 2, size));
+    offset += 2 + size;
+  }
+
+  return true;
+}
+
+bool fragment_datagram(vector<Datagram> &fragments, LinkCodec *codec, const void *data, size_t length, int header_size)
+{
+  size_t fragment_size = (size_t)max(otp_fragment_size.get_value(), 1);
+  if (codec == nullptr || !(codec->get_options() & LINK_OPTION_FRAGMENTATION) || length <= fragment_size || length > UINT32_MAX)
+  {
+    return false;
+  }
+
+  // the message is encoded as a whole and the encoded frame is what gets
+  // split up, the other end decodes it once it's back together
+  Datagram encoded;
+  if (codec->encode(data, length, encoded))
+  {
+    data = encoded.get_data();
+    length = encoded.get_length();
+  }
+
+  const unsigned char *bytes = (const unsigned char*)data;
+  uint32_t id = codec->m_next_fragment_id++;
+  fragments.reserve(fragments.size() + (length + fragment_size - 1) / fragment_size);
+  for (size_t offset = 0; offset < length; offset += fragment_size)
+  {
+    size_t chunk_length = min(fragment_size, length - offset);
+
+    Datagram fragment;
+    fragment.add_uint8(LINK_FRAME_FRAGMENT);
+    fragment.add_uint32(id);
+    fragment.add_uint32((uint32_t)length);
+    fragment.append_data(bytes + offset, chunk_length);
+
+    Datagram packed;
+    if (!pack_datagram(packed, nullptr, fragment.get_data(), fragment.get_length(), header_size))
+    {
+      fragments.clear();
+      return false;
+    }
+
+    fragments.push_back(packed);
+  }
+
+  codec->m_num_fragmented++;
+  return true;
+}
+
+uint8_t get_datagram_lane(const void *data, size_t length)
+{
+  // a control message is a single channel, the control channel, followed
+  // by the message type; the channel is little endian on the wire
+  const unsigned char *bytes = (const unsigned char*)data;
+  if (length < 9 || bytes[0] != 1)
+  {
+    return NETWORK_LANE_BULK;
+  }
+
+  uint64_t channel = 0;
+  for (int i = 8; i > 0; i--)
+  {
+    channel = (channel << 8) | bytes[i];
+  }
+
+  return channel == CONTROL_MESSAGE ? NETWORK_LANE_CONTROL : NETWORK_LANE_BULK;
+}
+
+bool get_order_key(const void *data, size_t length, OrderKey &key)
+{
+  MessageHeader header;
+  if (!header.parse((const unsigned char*)data, length) || header.m_control)
+  {
+    return false;
+  }
+
+  key.m_channel = header.get_channel(0);
+  key.m_sender = header.m_sender;
+  return true;
+}
+
+DatagramRing::DatagramRing(size_t capacity)
+  : m_num_full(0), m_num_retries(0), m_enqueue_pos(0), m_dequeue_pos(0)
+{
+  // round up to a power of two so positions wrap with a mask
+  size_t size = 2;
+  while (size < capacity)
+  {
+    size <<= 1;
+  }
+
+  m_cells = new Cell[size];
+  m_mask = size - 1;
+  for (size_t i = 0; i < size; i++)
+  {
+    m_cells[i].m_sequence.store(i, memory_order_relaxed);
+  }
+}
+
+DatagramRing::~DatagramRing()
+{
+  delete[] m_cells;
+}
+
+bool DatagramRing::push(const NetDatagram &datagram)
+{
+  Cell *cell;
+  size_t pos = m_enqueue_pos.load(memory_order_relaxed);
+  for (;;)
+  {
+    cell = &m_cells[pos & m_mask];
+    size_t sequence = cell->m_sequence.load(memory_order_acquire);
+    intptr_t diff = (intptr_t)sequence - (intptr_t)pos;
+    if (diff == 0)
+    {
+      if (m_enqueue_pos.compare_exchange_weak(pos, pos + 1, memory_order_relaxed))
+      {
+        break;
+      }
+
+      m_num_retries.fetch_add(1, memory_order_relaxed);
+    }
+    else if (diff < 0)
+    {
+      m_num_full.fetch_add(1, memory_order_relaxed);
+      return false;
+    }
+    else
+    {
+      pos = m_enqueue_pos.load(memory_order_relaxed);
+    }
+  }
+
+  cell->m_datagram = datagram;
+  cell->m_sequence.store(pos + 1, memory_order_release);
+  return true;
+}
+
+bool DatagramRing::pop(NetDatagram &datagram)
+{
+  // we're the only consumer, so nobody else can move the dequeue position
+  size_t pos = m_dequeue_pos.load(memory_order_relaxed);
+  Cell *cell = &m_cells[pos & m_mask];
+  size_t sequence = cell->m_sequence.load(memory_order_acquire);
+  if ((intptr_t)sequence - (intptr_t)(pos + 1) < 0)
+  {
+    return false;
+  }
+
+  datagram = cell->m_datagram;
+  cell->m_datagram = NetDatagram();
+  m_dequeue_pos.store(pos + 1, memory_order_relaxed);
+  cell->m_sequence.store(pos + m_mask + 1, memory_order_release);
+  return true;
+}
+
+size_t DatagramRing::size()
+{
+  size_t enqueue_pos = m_enqueue_pos.load(memory_order_relaxed);
+  size_t dequeue_pos = m_dequeue_pos.load(memory_order_relaxed);
+  return enqueue_pos > dequeue_pos ? enqueue_pos - dequeue_pos : 0;
+}
+
+LaneConnectionReader::LaneConnectionReader(ConnectionManager *manager, size_t num_threads, bool lock_free)
+  : ConnectionReader(manager, num_threads), m_lock_free(lock_free)
+{
+  if (m_lock_free)
+  {
+    for (uint8_t lane = 0; lane < NUM_NETWORK_LANES; lane++)
+    {
+      m_rings[lane] = new DatagramRing(otp_reader_ring_size);
+    }
+  }
+}
+
+LaneConnectionReader::~LaneConnectionReader()
+{
+  // make sure the reader threads are gone before our lanes are destroyed
+  shutdown();
+
+  for (uint8_t lane = 0; lane < NUM_NETWORK_LANES; lane++)
+  {
+    delete m_rings[lane];
+  }
+}
+
+bool LaneConnectionReader::data_available()
+{
+  poll();
+  return get_total_size() > 0;
+}
+
+bool LaneConnectionReader::get_data(NetDatagram &datagram)
+{
+  if (m_lock_free)
+  {
+    for (uint8_t lane = 0; lane < NUM_NETWORK_LANES; lane++)
+    {
+      if (m_rings[lane]->pop(datagram))
+      {
+        return true;
+      }
+    }
+
+    return false;
+  }
+
+  LightMutexHolder holder(m_lock);
+  for (uint8_t lane = 0; lane < NUM_NETWORK_LANES; lane++)
+  {
+    deque<NetDatagram> &queue = m_lanes[lane];
+    if (!queue.empty())
+    {
+      datagram = queue.front();
+      queue.pop_front();
+      return true;
+    }
+  }
+
+  return false;
+}
+
+size_t LaneConnectionReader::get_datagrams(vector<NetDatagram> &datagrams, size_t max_datagrams)
+{
+  // without reader threads every poll reads at most one datagram, so keep
+  // polling until the sockets have nothing more for us or we have enough
+  if (is_polling())
+  {
+    size_t total_size = get_total_size();
+    while (total_size < max_datagrams)
+    {
+      poll();
+
+      size_t new_size = get_total_size();
+      if (new_size == total_size)
+      {
+        break;
+      }
+
+      total_size = new_size;
+    }
+  }
+
+  return take_datagrams(datagrams, max_datagrams);
+}
+
+bool LaneConnectionReader::is_lock_free()
+{
+  return m_lock_free;
+}
+
+size_t LaneConnectionReader::get_lane_size(uint8_t lane)
+{
+  nassertr(lane < NUM_NETWORK_LANES, 0);
+  if (m_lock_free)
+  {
+    return m_rings[lane]->size();
+  }
+
+  LightMutexHolder holder(m_lock);
+  return m_lanes[lane].size();
+}
+
+size_t LaneConnectionReader::get_lane_high_water(uint8_t lane)
+{
+  nassertr(lane < NUM_NETWORK_LANES, 0);
+  LightMutexHolder holder(m_lock);
+  return m_high_water[lane];
+}
+
+uint64_t LaneConnectionReader::get_num_ring_full()
+{
+  uint64_t num_full = 0;
+  for (uint8_t lane = 0; m_lock_free && lane < NUM_NETWORK_LANES; lane++)
+  {
+    num_full += m_rings[lane]->m_num_full.load(memory_order_relaxed);
+  }
+
+  return num_full;
+}
+
+uint64_t LaneConnectionReader::get_num_ring_retries()
+{
+  uint64_t num_retries = 0;
+  for (uint8_t lane = 0; m_lock_free && lane < NUM_NETWORK_LANES; lane++)
+  {
+    num_retries += m_rings[lane]->m_num_retries.load(memory_order_relaxed);
+  }
+
+  return num_retries;
+}
+
+void LaneConnectionReader::receive_datagram(const NetDatagram &datagram)
+{
+  uint8_t lane = get_datagram_lane(datagram.get_data(), datagram.get_length());
+  if (m_lock_free)
+  {
+    // a full ring pushes back on this reader thread rather than dropping,
+    // the same as the socket would if we stopped reading
+    while (!m_rings[lane]->push(datagram))
+    {
+      Thread::force_yield();
+    }
+
+    return;
+  }
+
+  LightMutexHolder holder(m_lock);
+  deque<NetDatagram> &queue = m_lanes[lane];
+  queue.push_back(datagram);
+  m_high_water[lane] = max(m_high_water[lane], queue.size());
+}
+
+size_t LaneConnectionReader::get_total_size()
+{
+  size_t size = 0;
+  if (m_lock_free)
+  {
+    for (uint8_t lane = 0; lane < NUM_NETWORK_LANES; lane++)
+    {
+      size += m_rings[lane]->size();
+    }
+
+    return size;
+  }
+
+  LightMutexHolder holder(m_lock);
+  for (uint8_t lane = 0; lane < NUM_NETWORK_LANES; lane++)
+  {
+    size += m_lanes[lane].size();
+  }
+
+  return size;
+}
+
+size_t LaneConnectionReader::take_datagrams(vector<NetDatagram> &datagrams, size_t max_datagrams)
+{
+  size_t count = 0;
+  if (m_lock_free)
+  {
+    NetDatagram datagram;
+    for (uint8_t lane = 0; lane < NUM_NETWORK_LANES && count < max_datagrams; lane++)
+    {
+      DatagramRing *ring = m_rings[lane];
+
+      // the consumer is the only one who can see the rings' depth without
+      // racing, so we track their high water marks here
+      LightMutexHolder holder(m_lock);
+      m_high_water[lane] = max(m_high_water[lane], ring->size());
+
+      while (count < max_datagrams && ring->pop(datagram))
+      {
+        datagrams.push_back(datagram);
+        count++;
+      }
+    }
+
+    return count;
+  }
+
+  // one lock for the whole batch rather than one per datagram
+  LightMutexHolder holder(m_lock);
+  for (uint8_t lane = 0; lane < NUM_NETWORK_LANES && count < max_datagrams; lane++)
+  {
+    deque<NetDatagram> &queue = m_lanes[lane];
+    while (count < max_datagrams && !queue.empty())
+    {
+      datagrams.push_back(queue.front());
+      queue.pop_front();
+      count++;
+    }
+  }
+
+  return count;
+}
+
+WriterFrameSink::WriterFrameSink(ConnectionWriter *writer)
+  : m_writer(writer)
+{
+
+}
+
+bool WriterFrameSink::send_frame(const Datagram &framed, const PT(Connection) &connection)
+{
+  return m_writer->send(framed, connection);
+}
+
+size_t WriterFrameSink::get_queue_size(const PT(Connection) &connection)
+{
+  return m_writer->get_current_queue_size();
+}
+
+void AcceptorConnectionManager::take_lost_connections(vector<PT(Connection)> &connections)
+{
+  LightMutexHolder holder(m_lock);
+  connections.swap(m_lost_connections);
+  m_lost_connections.clear();
+}
+
+void AcceptorConnectionManager::connection_reset(const PT(Connection) &connection, bool okflag)
+{
+  QueuedConnectionManager::connection_reset(connection, okflag);
+
+  // the reader keeps reporting a socket until we take it out of its set,
+  // which only happens once the acceptor gets around to it
+  LightMutexHolder holder(m_lock);
+  if (find(m_lost_connections.begin(), m_lost_connections.end(), connection) == m_lost_connections.end())
+  {
+    m_lost_connections.push_back(connection);
+  }
+}
+
+bool OutboundLanes::has_pending(uint8_t lane)
+{
+  for (uint8_t i = 0; i <= lane && i < NUM_NETWORK_LANES; i++)
+  {
+    if (!m_lanes[i].empty())
+    {
+      return true;
+    }
+  }
+
+  return false;
+}
+
+bool OutboundLanes::send(FrameSink &sink, const PT(Connection) &connection, uint8_t lane, const Datagram &datagram,
+                         const ConflationKey *key)
+{
+  // control traffic always goes straight to the writer, everything else is
+  // held back while the writer is backed up or while anything of the same
+  // or higher priority is still waiting, to keep the writer queue short
+  if (lane == NETWORK_LANE_CONTROL || (!has_pending(lane) && sink.get_queue_size(connection) < (size_t)otp_writer_queue_limit))
+  {
+    return sink.send_frame(datagram, connection);
+  }
+
+  deque<Datagram> &queue = m_lanes[lane];
+  if (key != nullptr)
+  {
+    // a newer update to the same thing takes the place in line of the one
+    // it supersedes, everything queued around it keeps its order
+    unordered_map<ConflationKey, uint64_t, ConflationKeyHash> &conflation = m_conflation[lane];
+    unordered_map<ConflationKey, uint64_t, ConflationKeyHash>::iterator it = conflation.find(*key);
+    if (it != conflation.end() && it->second >= m_lane_base[lane])
+    {
+      Datagram &slot = queue[it->second - m_lane_base[lane]];
+      m_num_bytes -= slot.get_length();
+      m_num_bytes += datagram.get_length();
+      slot = datagram;
+      m_num_conflated++;
+      return true;
+    }
+
+    conflation[*key] = m_lane_base[lane] + queue.size();
+  }
+
+  queue.push_back(datagram);
+  m_high_water[lane] = max(m_high_water[lane], queue.size());
+  m_num_bytes += datagram.get_length();
+  return true;
+}
+
+void OutboundLanes::stream(const vector<Datagram> &fragments, const OrderKey *key)
+{
+  for (const Datagram &fragment : fragments)
+  {
+    StreamFrame frame;
+    frame.m_frame = fragment;
+    m_stream.push_back(frame);
+    m_num_bytes += fragment.get_length();
+  }
+
+  if (key != nullptr && !m_stream.empty())
+  {
+    m_stream.back().m_key = *key;
+    m_stream.back().m_release = true;
+    m_streaming[*key]++;
+  }
+}
+
+void OutboundLanes::stream_behind(const Datagram &framed, const OrderKey &key)
+{
+  StreamFrame frame;
+  frame.m_frame = framed;
+  frame.m_key = key;
+  frame.m_release = true;
+  m_stream.push_back(frame);
+  m_num_bytes += framed.get_length();
+  m_streaming[key]++;
+}
+
+bool OutboundLanes::is_streaming(const OrderKey &key)
+{
+  return !m_streaming.empty() && m_streaming.find(key) != m_streaming.end();
+}
+
+bool OutboundLanes::is_streaming()
+{
+  return !m_streaming.empty();
+}
+
+bool OutboundLanes::flush(FrameSink &sink, const PT(Connection) &connection)
+{
+  // fragments only give way to other traffic when there is some, otherwise
+  // the stream goes out as fast as the writer queue allows
+  bool contended = has_pending(NUM_NETWORK_LANES - 1);
+  for (uint8_t lane = 0; lane < NUM_NETWORK_LANES; lane++)
+  {
+    deque<Datagram> &queue = m_lanes[lane];
+    while (!queue.empty())
+    {
+      if (sink.get_queue_size(connection) >= (size_t)otp_writer_queue_limit)
+      {
+        return false;
+      }
+
+      sink.send_frame(queue.front(), connection);
+      m_num_bytes -= queue.front().get_length();
+      queue.pop_front();
+      m_lane_base[lane]++;
+    }
+
+    m_conflation[lane].clear();
+  }
+
+  for (int count = 0; (!contended || count < otp_fragment_burst) && !m_stream.empty(); count++)
+  {
+    if (sink.get_queue_size(connection) >= (size_t)otp_writer_queue_limit)
+    {
+      return false;
+    }
+
+    StreamFrame &frame = m_stream.front();
+    sink.send_frame(frame.m_frame, connection);
+    m_num_bytes -= frame.m_frame.get_length();
+    if (frame.m_release)
+    {
+      unordered_map<OrderKey, size_t, OrderKeyHash>::iterator it = m_streaming.find(frame.m_key);
+      if (it != m_streaming.end() && !--it->second)
+      {
+        m_streaming.erase(it);
+      }
+    }
+
+    m_stream.pop_front();
+  }
+
+  return m_stream.empty();
+}
+
+size_t OutboundLanes::get_lane_size(uint8_t lane)
+{
+  nassertr(lane < NUM_NETWORK_LANES, 0);
+  return m_lanes[lane].size();
+}
+
+size_t OutboundLanes::get_lane_high_water(uint8_t lane)
+{
+  nassertr(lane < NUM_NETWORK_LANES, 0);
+  return m_high_water[lane];
+}
+
+size_t OutboundLanes::get_stream_size()
+{
+  return m_stream.size();
+}
+
+size_t OutboundLanes::get_num_bytes()
+{
+  return m_num_bytes;
+}
+
+uint64_t OutboundLanes::get_num_conflated()
+{
+  return m_num_conflated;
+}
+
+void TokenBucket::set_rate(double rate, double burst)
+{
+  m_rate = rate;
+  m_burst = rate * burst;
+  m_tokens = m_burst;
+  m_last = TrueClock::get_global_ptr()->get_short_time();
+}
+
+void TokenBucket::refill(double now)
+{
+  if (m_rate <= 0.0)
+  {
+    return;
+  }
+
+  m_tokens = min(m_burst, m_tokens + (now - m_last) * m_rate);
+  m_last = now;
+}
+
+bool TokenBucket::has_tokens(double amount)
+{
+  // a full bucket lets anything through, so a single datagram larger than
+  // the burst is slowed down instead of being stuck forever
+  return m_rate <= 0.0 || m_tokens >= amount || m_tokens >= m_burst;
+}
+
+NetworkConnector::NetworkConnector(const char *address, uint16_t port, int timeout_ms, size_t num_threads, uint8_t backend)
+  : m_address(address), m_port(port), m_timeout_ms(timeout_ms), m_backend(backend),
+    m_reader(&m_manager, num_threads, otp_lock_free_reader), m_writer(&m_manager, num_threads),
+    m_writer_sink(&m_writer), m_udp_writer(&m_manager, 0)
+{
+  // we frame datagrams ourselves, see pack_datagram
+  m_writer.set_raw_mode(true);
+  m_sink = &m_writer_sink;
+
+  // setup our connection
+  setup_connection();
+
+  // setup up our polling tasks
+  m_reader_task = new GenericAsyncTask("_reader_task", &NetworkConnector::reader_poll, this);
+  m_writer_task = new GenericAsyncTask("_writer_task", &NetworkConnector::writer_poll, this);
+  m_disconnect_task = new GenericAsyncTask("_disconnect_task", &NetworkConnector::disconnect_poll, this);
+
+  task_mgr->add(m_reader_task);
+  task_mgr->add(m_writer_task);
+  task_mgr->add(m_disconnect_task);
+}
+
+NetworkConnector::~NetworkConnector()
+{
+  task_mgr->remove(m_reader_task);
+  task_mgr->remove(m_writer_task);
+  task_mgr->remove(m_disconnect_task);
+
+  delete m_uring;
+}
+
+void NetworkConnector::setup_connection()
+{
+  m_connection = m_manager.open_TCP_client_connection(m_address, m_port, m_timeout_ms);
+  if (!m_connection)
+  {
+    throw runtime_error("Failed to open TCP client connection!");
+  }
+
+  m_uring = open_io_uring(m_backend, m_writer.get_tcp_header_size());
+  if (m_uring != nullptr)
+  {
+    m_uring->add_connection(m_connection);
+    m_sink = m_uring;
+  }
+  else
+  {
+    m_reader.add_connection(m_connection);
+  }
+
+  // ask for the link options we want before anything else goes out, frames
+  // stay readable either way so we can start decoding right away
+  uint8_t options = get_supported_link_options();
+  if (options)
+  {
+    Datagram request;
+    request.add_uint8(1);
+    request.add_uint64(CONTROL_MESSAGE);
+    request.add_uint16(CONTROL_SET_LINK_OPTIONS);
+    request.add_uint64(0);
+    request.add_uint8(options);
+    send_datagram(request);
+
+    // nothing is escaped or decoded until the other end answers, one that
+    // never does keeps reading our frames exactly as they are
+    m_awaiting_link_options = true;
+  }
+
+  // the side channel is asked for over TCP, see handle_udp_endpoint
+  if (otp_udp_side_channel && m_uring == nullptr)
+  {
+    Datagram request;
+    request.add_uint8(1);
+    request.add_uint64(CONTROL_MESSAGE);
+    request.add_uint16(CONTROL_SET_UDP_ENDPOINT);
+    request.add_uint64(0);
+    send_datagram(request);
+
+    m_awaiting_udp_endpoint = true;
+  }
+}
+
+bool NetworkConnector::handle_link_options(const Datagram &datagram)
+{
+  if (datagram.get_length() != 20)
+  {
+    return false;
+  }
+
+  DatagramIterator iterator(datagram);
+  if (iterator.get_uint8() != 1 || iterator.get_uint64() != CONTROL_MESSAGE)
+  {
+    return false;
+  }
+
+  iterator.get_uint64();
+  if (iterator.get_uint16() != CONTROL_SET_LINK_OPTIONS)
+  {
+    return false;
+  }
+
+  // we only encode with the options the other end granted us
+  m_codec.set_options(iterator.get_uint8());
+  m_codec.set_negotiated(true);
+  m_awaiting_link_options = false;
+
+  vector<Datagram> held;
+  held.swap(m_held_datagrams);
+  for (Datagram &datagram : held)
+  {
+    send_datagram(datagram);
+  }
+
+  return true;
+}
+
+bool NetworkConnector::hold_datagram(const void *data, size_t length)
+{
+  // until the options are settled a message whose first byte collides with
+  // a frame marker means something different to each kind of peer
+  if (!m_awaiting_link_options || !length)
+  {
+    return false;
+  }
+
+  if (m_held_datagrams.empty() && ((const unsigned char*)data)[0] < LINK_FRAME_MARKER)
+  {
+    return false;
+  }
+
+  m_held_datagrams.push_back(Datagram(data, length));
+  return true;
+}
+
+bool NetworkConnector::handle_udp_endpoint(const Datagram &datagram)
+{
+  if (datagram.get_length() != 25)
+  {
+    return false;
+  }
+
+  DatagramIterator iterator(datagram);
+  if (iterator.get_uint8() != 1 || iterator.get_uint64() != CONTROL_MESSAGE)
+  {
+    return false;
+  }
+
+  iterator.get_uint64();
+  if (iterator.get_uint16() != CONTROL_SET_UDP_ENDPOINT)
+  {
+    return false;
+  }
+
+  uint16_t port = iterator.get_uint16();
+  uint32_t token = iterator.get_uint32();
+  m_awaiting_udp_endpoint = false;
+  if (!port || !token)
+  {
+    libotp_cat.info() << "The message director has no UDP side channel, staying on TCP." << endl;
+    return true;
+  }
+
+  m_udp_connection = m_manager.open_UDP_connection();
+  if (!m_udp_connection)
+  {
+    libotp_cat.warning() << "Failed to open the UDP side channel, staying on TCP!" << endl;
+    return true;
+  }
+
+  // the hello goes out from writer_poll, until it's echoed back everything
+  // keeps going over TCP
+  m_udp_address.set_host(m_address, port);
+  m_udp_token = token;
+  m_udp_hello_time = 0.0;
+  m_reader.add_connection(m_udp_connection);
+  return true;
+}
+
+LinkCodec* NetworkConnector::get_link_codec()
+{
+  return &m_codec;
+}
+
+TraceAggregator* NetworkConnector::get_trace_aggregator()
+{
+  return &m_traces;
+}
+
+bool NetworkConnector::send_datagram(Datagram &datagram)
+{
+  // unreliable updates skip the lanes and the link codec entirely once the
+  // side channel is up
+  if (m_udp_ready)
+  {
+    Datagram frame;
+    if (pack_unreliable_datagram(frame, m_udp_outbound, datagram.get_data(), datagram.get_length(), m_unreliable_types))
+    {
+      return send_udp_frame(frame);
+    }
+  }
+
+  if (hold_datagram(datagram.get_data(), datagram.get_length()))
+  {
+    return true;
+  }
+
+  if ((m_codec.get_options() & LINK_OPTION_TRACING) && otp_trace_sample_rate > 0)
+  {
+    if (!m_trace_countdown)
+    {
+      m_trace_countdown = otp_trace_sample_rate;
+
+      TraceRecord trace;
+      trace.m_id = ++m_trace_id;
+      trace.stamp(TRACE_STAGE_SEND);
+      m_codec.attach_trace(trace);
+    }
+
+    m_trace_countdown--;
+  }
+
+  // only messages that have to keep their order with the stream are keyed,
+  // everything else is never parsed for it
+  OrderKey order_key;
+  vector<Datagram> fragments;
+  if (fragment_datagram(fragments, &m_codec, datagram.get_data(), datagram.get_length(), m_writer.get_tcp_header_size()))
+  {
+    bool ordered = get_order_key(datagram.get_data(), datagram.get_length(), order_key);
+    m_outbound.stream(fragments, ordered ? &order_key : nullptr);
+    return true;
+  }
+
+  Datagram packed;
+  if (!pack_datagram(packed, &m_codec, datagram.get_data(), datagram.get_length(), m_writer.get_tcp_header_size()))
+  {
+    return false;
+  }
+
+  // anything following a fragmented message of the same sender and channel
+  // waits for it to finish going out
+  if (m_outbound.is_streaming() && get_order_key(datagram.get_data(), datagram.get_length(), order_key) &&
+      m_outbound.is_streaming(order_key))
+  {
+    m_outbound.stream_behind(packed, order_key);
+    return true;
+  }
+
+  uint8_t lane = get_datagram_lane(datagram.get_data(), datagram.get_length());
+  return m_outbound.send(*m_sink, m_connection, lane, packed);
+}
+
+bool NetworkConnector::send_datagrams(const Datagram &packed)
+{
+  if (m_awaiting_link_options || m_outbound.is_streaming())
+  {
+    // one at a time, so any of them can be held back or kept in order
+    // behind the stream
+    vector<Datagram> datagrams;
+    if (!unpack_datagrams(datagrams, packed))
+    {
+      return false;
+    }
+
+    return send_datagrams(datagrams);
+  }
+
+  Datagram framed;
+  uint8_t lane = NETWORK_LANE_BULK;
+  if (!repack_datagrams(framed, &m_codec, packed, m_writer.get_tcp_header_size(), &lane))
+  {
+    return false;
+  }
+
+  if (!framed.get_length())
+  {
+    return true;
+  }
+
+  return m_outbound.send(*m_sink, m_connection, lane, framed);
+}
+
+bool NetworkConnector::send_datagrams(const vector<Datagram> &datagrams)
+{
+  if (m_awaiting_link_options || m_outbound.is_streaming())
+  {
+    for (const Datagram &datagram : datagrams)
+    {
+      Datagram copy(datagram);
+      if (!send_datagram(copy))
+      {
+        return false;
+      }
+    }
+
+    return true;
+  }
+
+  Datagram packed;
+  uint8_t lane = NETWORK_LANE_BULK;
+  for (const Datagram &datagram : datagrams)
+  {
+    if (!pack_datagram(packed, &m_codec, datagram.get_data(), datagram.get_length(), m_writer.get_tcp_header_size()))
+    {
+      return false;
+    }
+
+    lane = min(lane, get_datagram_lane(datagram.get_data(), datagram.get_length()));
+  }
+
+  if (!packed.get_length())
+  {
+    return true;
+  }
+
+  return m_outbound.send(*m_sink, m_connection, lane, packed);
+}
+
+void NetworkConnector::receive_datagram(DatagramIterator &iterator)
+{
+
+}
+
+void NetworkConnector::disconnected()
+{
+
+}
+
+void NetworkConnector::disconnect()
+{
+  if (m_uring != nullptr)
+  {
+    m_uring->remove_connection(m_connection);
+  }
+  else
+  {
+    m_reader.remove_connection(m_connection);
+  }
+
+  if (m_udp_connection != nullptr)
+  {
+    m_reader.remove_connection(m_udp_connection);
+    m_manager.close_connection(m_udp_connection);
+    m_udp_connection = nullptr;
+    m_udp_ready = false;
+  }
+
+  // nothing we're waiting on is coming anymore
+  m_requests.cancel_all();
+
+  disconnected();
+}
+
+size_t NetworkConnector::get_inbound_lane_size(uint8_t lane)
+{
+  return m_reader.get_lane_size(lane);
+}
+
+size_t NetworkConnector::get_inbound_lane_high_water(uint8_t lane)
+{
+  return m_reader.get_lane_high_water(lane);
+}
+
+size_t NetworkConnector::get_outbound_lane_size(uint8_t lane)
+{
+  return m_outbound.get_lane_size(lane);
+}
+
+size_t NetworkConnector::get_outbound_lane_high_water(uint8_t lane)
+{
+  return m_outbound.get_lane_high_water(lane);
+}
+
+size_t NetworkConnector::get_outbound_stream_size()
+{
+  return m_outbound.get_stream_size();
+}
+
+bool NetworkConnector::is_io_uring()
+{
+  return m_uring != nullptr;
+}
+
+uint64_t NetworkConnector::get_num_io_submits()
+{
+  return m_uring != nullptr ? m_uring->m_num_submits : 0;
+}
+
+uint64_t NetworkConnector::get_num_io_messages()
+{
+  return m_uring != nullptr ? m_uring->m_num_received + m_uring->m_num_sent : 0;
+}
+
+void NetworkConnector::set_unreliable_message_type(uint16_t message_type, bool unreliable)
+{
+  m_unreliable_types.set(message_type, unreliable);
+}
+
+bool NetworkConnector::is_unreliable_message_type(uint16_t message_type)
+{
+  return m_unreliable_types.has(message_type);
+}
+
+bool NetworkConnector::is_udp_ready()
+{
+  return m_udp_ready;
+}
+
+uint64_t NetworkConnector::get_num_udp_sent()
+{
+  return m_num_udp_sent;
+}
+
+uint64_t NetworkConnector::get_num_udp_received()
+{
+  return m_num_udp_received;
+}
+
+uint64_t NetworkConnector::get_num_udp_stale()
+{
+  return m_num_udp_stale;
+}
+
+uint64_t NetworkConnector::get_num_udp_lost()
+{
+  return m_num_udp_lost;
+}
+
+uint64_t NetworkConnector::get_num_received()
+{
+  return m_num_received;
+}
+
+PT(ResponseFuture) NetworkConnector::send_request(Datagram &datagram, uint16_t response_type, double timeout)
+{
+  MessageHeader header;
+  if (!header.parse(datagram.get_data(), datagram.get_length()) || header.m_control)
+  {
+    libotp_cat.warning() << "Refusing to send a malformed request!" << endl;
+    return nullptr;
+  }
+
+  if (timeout < 0.0)
+  {
+    timeout = otp_request_timeout;
+  }
+
+  double now = TrueClock::get_global_ptr()->get_short_time();
+  PT(ResponseFuture) future = m_requests.open(response_type, now + timeout);
+  if (future == nullptr)
+  {
+    // hand back a future that's already cancelled, so the caller's await
+    // fails the same way it would on a timeout
+    libotp_cat.warning() << "Too many requests in flight, cancelling a request!" << endl;
+    future = new ResponseFuture(0, response_type);
+    future->cancel();
+    return future;
+  }
+
+  // the context goes at the very start of the payload, which is where the
+  // servers look for it and echo it back in their response
+  Datagram request;
+  request.append_data(datagram.get_data(), header.m_header_length);
+  request.add_uint32(future->get_context());
+  request.append_data(header.m_payload, header.m_payload_length);
+  if (!send_datagram(request))
+  {
+    m_requests.cancel(future->get_context());
+  }
+
+  return future;
+}
+
+size_t NetworkConnector::get_num_requests_in_flight()
+{
+  return m_requests.size();
+}
+
+uint64_t NetworkConnector::get_num_requests_completed()
+{
+  return m_num_requests_completed;
+}
+
+uint64_t NetworkConnector::get_num_requests_timed_out()
+{
+  return m_num_requests_timed_out;
+}
+
+bool NetworkConnector::complete_request(const Datagram &datagram)
+{
+  MessageHeader header;
+  if (!header.parse(datagram.get_data(), datagram.get_length()) || header.m_control || header.m_payload_length < 4)
+  {
+    return false;
+  }
+
+  if (!m_requests.complete(load_uint32(header.m_payload), header.m_message_type, datagram))
+  {
+    return false;
+  }
+
+  m_num_requests_completed++;
+  return true;
+}
+
+bool NetworkConnector::send_udp_frame(const Datagram &frame)
+{
+  if (should_drop_unreliable())
+  {
+    m_num_udp_lost++;
+    return true;
+  }
+
+  m_num_udp_sent++;
+  return m_udp_writer.send(frame, m_udp_connection, m_udp_address);
+}
+
+void NetworkConnector::receive_udp_datagram(NetDatagram &datagram)
+{
+  if (!(datagram.get_address() == m_udp_address))
+  {
+    return;
+  }
+
+  if (datagram.get_length() == UDP_HELLO_SIZE)
+  {
+    DatagramIterator iterator(datagram);
+    if (iterator.get_uint8() == UDP_FRAME_HELLO && iterator.get_uint32() == m_udp_token)
+    {
+      m_udp_ready = true;
+    }
+
+    return;
+  }
+
+  size_t offset;
+  bool stale;
+  if (!unpack_unreliable_datagram(datagram, m_udp_inbound, offset, stale))
+  {
+    if (stale)
+    {
+      m_num_udp_stale++;
+    }
+
+    return;
+  }
+
+  m_num_udp_received++;
+  m_num_received++;
+  DatagramIterator iterator(datagram, offset);
+  receive_datagram(iterator);
+}
+
+void NetworkConnector::dispatch_datagram(NetDatagram &datagram)
+{
+  if (m_awaiting_link_options && handle_link_options(datagram))
+  {
+    return;
+  }
+
+  Datagram decoded;
+  if (m_codec.is_encoded(datagram))
+  {
+    if (!m_codec.decode(datagram, decoded))
+    {
+      libotp_cat.warning() << "Dropping a datagram that could not be decoded!" << endl;
+      return;
+    }
+
+    if (m_codec.is_incomplete())
+    {
+      return;
+    }
+
+    if (m_codec.has_received_trace())
+    {
+      m_codec.m_received_trace.stamp(TRACE_STAGE_RECEIVE);
+      m_traces.add(m_codec.m_received_trace);
+    }
+
+    deliver_datagram(decoded);
+    return;
+  }
+
+  deliver_datagram(datagram);
+}
+
+void NetworkConnector::deliver_datagram(const Datagram &datagram)
+{
+  if (m_awaiting_udp_endpoint && handle_udp_endpoint(datagram))
+  {
+    return;
+  }
+
+  if (m_requests.size() && complete_request(datagram))
+  {
+    return;
+  }
+
+  m_num_received++;
+  DatagramIterator iterator(datagram);
+  receive_datagram(iterator);
+}
+
+AsyncTask::DoneStatus NetworkConnector::reader_poll(GenericAsyncTask *task, void *data)
+{
+  NetworkConnector *self = (NetworkConnector*)data;
+  if (self->m_uring != nullptr)
+  {
+    // a lost connection is picked up by disconnect_poll, so the empty
+    // datagram the backend hands us for it can be skipped here
+    vector<int> accepted;
+    vector<NetDatagram> &batch = self->m_read_batch;
+    batch.clear();
+    self->m_uring->poll(batch, accepted);
+
+    for (NetDatagram &datagram : batch)
+    {
+      if (datagram.get_length())
+      {
+        self->dispatch_datagram(datagram);
+      }
+    }
+
+    batch.clear();
+    return AsyncTask::DS_cont;
+  }
+
+  if (self->m_reader.data_available())
+  {
+    NetDatagram datagram;
+    if (self->m_reader.get_data(datagram))
+    {
+      if (self->m_udp_connection != nullptr && datagram.get_connection() == self->m_udp_connection)
+      {
+        self->receive_udp_datagram(datagram);
+      }
+      else
+      {
+        self->dispatch_datagram(datagram);
+      }
+    }
+  }
+
+  return AsyncTask::DS_cont;
+}
+
+AsyncTask::DoneStatus NetworkConnector::writer_poll(GenericAsyncTask *task, void *data)
+{
+  NetworkConnector *self = (NetworkConnector*)data;
+  double now = TrueClock::get_global_ptr()->get_short_time();
+  if (self->m_requests.size())
+  {
+    self->m_num_requests_timed_out += self->m_requests.expire(now);
+  }
+
+  if (self->m_udp_connection != nullptr && !self->m_udp_ready)
+  {
+    // keep saying hello until the message director answers, the hello may
+    // well be lost along the way
+    if (now >= self->m_udp_hello_time)
+    {
+      Datagram hello;
+      hello.add_uint8(UDP_FRAME_HELLO);
+      hello.add_uint32(self->m_udp_token);
+      self->send_udp_frame(hello);
+      self->m_udp_hello_time = now + otp_udp_hello_interval;
+    }
+  }
+
+  self->m_outbound.flush(*self->m_sink, self->m_connection);
+  if (self->m_uring != nullptr)
+  {
+    self->m_uring->flush();
+  }
+
+  return AsyncTask::DS_cont;
+}
+
+AsyncTask::DoneStatus NetworkConnector::disconnect_poll(GenericAsyncTask *task, void *data)
+{
+  NetworkConnector *self = (NetworkConnector*)data;
+  bool connection_ok = self->m_uring != nullptr ? self->m_uring->is_connection_ok(self->m_connection)
+                                                : self->m_reader.is_connection_ok(self->m_connection);
+  if (!connection_ok)
+  {
+    self->disconnect();
+    return AsyncTask::DS_done;
+  }
+
+  return AsyncTask::DS_cont;
+}
+
+NetworkHandler::NetworkHandler(NetworkAcceptor *acceptor, PT(Connection) rendezvous, NetAddress address, PT(Connection) connection)
+  : m_acceptor(acceptor), m_rendezvous(rendezvous), m_address(address), m_connection(connection)
+{
+
+}
+
+NetworkHandler::~NetworkHandler()
+{
+
+}
+
+bool NetworkHandler::send_datagram(Datagram &datagram)
+{
+  return m_acceptor->send_handler_datagram(this, datagram);
+}
+
+bool NetworkHandler::send_datagrams(const Datagram &packed)
+{
+  return m_acceptor->send_handler_datagrams(this, packed);
+}
+
+bool NetworkHandler::send_unreliable_datagram(Datagram &datagram)
+{
+  return m_acceptor->send_handler_unreliable(this, datagram);
+}
+
+bool NetworkHandler::send_datagrams(const vector<Datagram> &datagrams)
+{
+  return m_acceptor->send_handler_datagrams(this, datagrams);
+}
+
+void NetworkHandler::receive_datagram(DatagramIterator &iterator)
+{
+
+}
+
+void NetworkHandler::disconnected()
+{
+
+}
+
+LinkCodec* NetworkHandler::get_link_codec()
+{
+  return &m_codec;
+}
+
+bool NetworkHandler::has_udp_endpoint()
+{
+  return m_has_udp_endpoint;
+}
+
+uint64_t NetworkHandler::get_num_conflated()
+{
+  return m_outbound.get_num_conflated();
+}
+
+void NetworkHandler::set_ingress_limits(double messages_per_second, double bytes_per_second)
+{
+  m_message_bucket.set_rate(messages_per_second, otp_ingress_burst);
+  m_byte_bucket.set_rate(bytes_per_second, otp_ingress_burst);
+}
+
+size_t NetworkHandler::get_num_deferred()
+{
+  return m_deferred.size();
+}
+
+size_t NetworkHandler::get_buffered_size()
+{
+  // everything we're holding on the handler's behalf, on the way out, held
+  // back by its ingress limits, waiting on the rest of its fragments or
+  // tracking the sequence of its unreliable updates
+  return m_outbound.get_num_bytes() + m_deferred_size + m_codec.get_reassembly_size() +
+         m_udp_outbound.get_size() + m_udp_inbound.get_size();
+}
+
+uint64_t NetworkHandler::get_num_dropped()
+{
+  return m_num_dropped;
+}
+
+bool NetworkHandler::consume_ingress(size_t length, double now)
+{
+  m_message_bucket.refill(now);
+  m_byte_bucket.refill(now);
+  if (!m_message_bucket.has_tokens(1.0) || !m_byte_bucket.has_tokens((double)length))
+  {
+    return false;
+  }
+
+  m_message_bucket.m_tokens -= 1.0;
+  m_byte_bucket.m_tokens -= (double)length;
+  return true;
+}
+
+size_t NetworkHandler::get_outbound_lane_size(uint8_t lane)
+{
+  return m_outbound.get_lane_size(lane);
+}
+
+size_t NetworkHandler::get_outbound_lane_high_water(uint8_t lane)
+{
+  return m_outbound.get_lane_high_water(lane);
+}
+
+size_t NetworkHandler::get_outbound_stream_size()
+{
+  return m_outbound.get_stream_size();
+}
+
+NetworkAcceptor::NetworkAcceptor(const char *address, uint16_t port, uint32_t backlog, size_t num_threads, uint8_t backend)
+  : m_address(address), m_port(port), m_backlog(backlog), m_backend(backend), m_listener(&m_manager, num_threads),
+    m_reader(&m_manager, num_threads, otp_lock_free_reader), m_writer(&m_manager, num_threads),
+    m_writer_sink(&m_writer), m_udp_writer(&m_manager, 0)
+{
+  // we frame datagrams ourselves, see pack_datagram
+  m_writer.set_raw_mode(true);
+  m_sink = &m_writer_sink;
+
+  m_ingress_message_rate = otp_ingress_message_rate;
+  m_ingress_byte_rate = otp_ingress_byte_rate;
+
+  string action = otp_ingress_action;
+  if (action == "drop")
+  {
+    m_ingress_action = INGRESS_ACTION_DROP;
+  }
+  else if (action == "disconnect")
+  {
+    m_ingress_action = INGRESS_ACTION_DISCONNECT;
+  }
+  else
+  {
+    m_ingress_action = INGRESS_ACTION_DEFER;
+  }
+
+  load_conflation_rules();
+
+  // setup our connection
+  setup_connection();
+
+  // setup up our polling tasks
+  m_listen_task = new GenericAsyncTask("_listen_task", &NetworkAcceptor::listener_poll, this);
+  m_reader_task = new GenericAsyncTask("_reader_task", &NetworkAcceptor::reader_poll, this);
+  m_writer_task = new GenericAsyncTask("_writer_task", &NetworkAcceptor::writer_poll, this);
+  m_disconnect_task = new GenericAsyncTask("_disconnect_task", &NetworkAcceptor::disconnect_poll, this);
+
+  task_mgr->add(m_listen_task);
+  task_mgr->add(m_reader_task);
+  task_mgr->add(m_writer_task);
+  task_mgr->add(m_disconnect_task);
+}
+
+NetworkAcceptor::~NetworkAcceptor()
+{
+  task_mgr->remove(m_listen_task);
+  task_mgr->remove(m_reader_task);
+  task_mgr->remove(m_writer_task);
+  task_mgr->remove(m_disconnect_task);
+
+  // closes every connection we're still holding, before the backend
+  // they're registered with goes away
+  while (!m_handlers_map.empty())
+  {
+    remove_handler(m_handlers_map.begin()->second);
+  }
+
+  delete m_uring;
+}
+
+void NetworkAcceptor::setup_connection()
+{
+  m_connection = m_manager.open_TCP_server_rendezvous(m_address, m_port, m_backlog);
+  if (!m_connection)
+  {
+    throw runtime_error("Failed to open TCP server rendezvous!");
+  }
+
+  m_handlers_map.reserve(m_backlog);
+
+  m_uring = open_io_uring(m_backend, m_writer.get_tcp_header_size());
+  if (m_uring != nullptr)
+  {
+    // accepts are reaped along with everything else in reader_poll
+    m_uring->listen(m_connection);
+    m_sink = m_uring;
+    return;
+  }
+
+  open_udp_channel();
+
+#ifdef __linux__
+  // we accept connections ourselves in listener_poll, draining the whole
+  // backlog every frame instead of taking one connection at a time
+  if (!m_connection->get_socket()->SetNonBlocking())
+  {
+    throw runtime_error("Failed to make TCP server rendezvous non-blocking!");
+  }
+#else
+  m_listener.add_connection(m_connection);
+#endif
+}
+
+bool NetworkAcceptor::has_handler(NetworkHandler *handler)
+{
+  assert(handler != nullptr);
+  unordered_map<Connection*, NetworkHandler*>::iterator it = m_handlers_map.begin();
+  it = m_handlers_map.find(handler->m_connection);
+  return it != m_handlers_map.end();
+}
+
+void NetworkAcceptor::add_handler(NetworkHandler *handler)
+{
+  assert(handler != nullptr);
+  if (has_handler(handler))
+  {
+    return;
+  }
+
+  handler->set_ingress_limits(m_ingress_message_rate, m_ingress_byte_rate);
+  m_handlers_map.insert(pair<Connection*, NetworkHandler*>(handler->m_connection, handler));
+  if (m_uring != nullptr)
+  {
+    m_uring->add_connection(handler->m_connection);
+  }
+  else
+  {
+    m_reader.add_connection(handler->m_connection);
+  }
+}
+
+void NetworkAcceptor::remove_handler(NetworkHandler *handler)
+{
+  assert(handler != nullptr);
+  if (!has_handler(handler))
+  {
+    return;
+  }
+
+  if (m_uring != nullptr)
+  {
+    m_uring->remove_connection(handler->m_connection);
+  }
+  else
+  {
+    m_reader.remove_connection(handler->m_connection);
+  }
+
+  if (handler->m_backlogged)
+  {
+    m_backlogged_handlers.erase(remove(m_backlogged_handlers.begin(), m_backlogged_handlers.end(), handler), m_backlogged_handlers.end());
+  }
+
+  if (handler->m_deferring)
+  {
+    m_deferring_handlers.erase(remove(m_deferring_handlers.begin(), m_deferring_handlers.end(), handler), m_deferring_handlers.end());
+  }
+
+  if (handler->m_udp_token)
+  {
+    m_udp_tokens.erase(handler->m_udp_token);
+  }
+
+  if (handler->m_has_udp_endpoint)
+  {
+    unordered_map<NetAddress, NetworkHandler*, NetAddressHash>::iterator uit;
+    uit = m_udp_handlers.find(handler->m_udp_address);
+    if (uit != m_udp_handlers.end() && uit->second == handler)
+    {
+      m_udp_handlers.erase(uit);
+    }
+  }
+
+  unordered_map<Connection*, NetworkHandler*>::iterator it;
+  it = m_handlers_map.find(handler->m_connection);
+  assert(it != m_handlers_map.end());
+  m_handlers_map.erase(handler->m_connection);
+
+  // sockets we accept ourselves never pass through the manager, so it
+  // doesn't know to close them and we do it here instead of leaving the
+  // socket open for as long as anything holds on to the connection
+  PT(Connection) connection = handler->m_connection;
+  if (!m_manager.close_connection(connection))
+  {
+    connection->get_socket()->Close();
+  }
+
+  delete handler;
+}
+
+NetworkHandler* NetworkAcceptor::get_handler(PT(Connection) connection)
+{
+  unordered_map<Connection*, NetworkHandler*>::iterator it;
+  it = m_handlers_map.find(connection);
+  if (it != m_handlers_map.end())
+  {
+    return it->second;
+  }
+
+  return nullptr;
+}
+
+bool NetworkAcceptor::send_handler_datagram(NetworkHandler *handler, Datagram &datagram)
+{
+  assert(handler != nullptr);
+  // only messages that have to keep their order with the stream are keyed,
+  // everything else is never parsed for it
+  OrderKey order_key;
+  vector<Datagram> fragments;
+  if (fragment_datagram(fragments, &handler->m_codec, datagram.get_data(), datagram.get_length(), m_writer.get_tcp_header_size()))
+  {
+    bool ordered = get_order_key(datagram.get_data(), datagram.get_length(), order_key);
+    submit_handler_fragments(handler, fragments, ordered ? &order_key : nullptr);
+    return true;
+  }
+
+  Datagram packed;
+  if (!pack_datagram(packed, &handler->m_codec, datagram.get_data(), datagram.get_length(), m_writer.get_tcp_header_size()))
+  {
+    return false;
+  }
+
+  // anything following a fragmented message of the same sender and channel
+  // waits for it to finish going out
+  if (handler->m_outbound.is_streaming() && get_order_key(datagram.get_data(), datagram.get_length(), order_key) &&
+      handler->m_outbound.is_streaming(order_key))
+  {
+    if (handler->m_disconnecting)
+    {
+      return false;
+    }
+
+    handler->m_outbound.stream_behind(packed, order_key);
+    return true;
+  }
+
+  uint8_t lane = get_datagram_lane(datagram.get_data(), datagram.get_length());
+  ConflationKey key;
+  if (get_conflation_key(datagram, key))
+  {
+    return submit_handler_datagram(handler, lane, packed, &key);
+  }
+
+  return submit_handler_datagram(handler, lane, packed);
+}
+
+bool NetworkAcceptor::send_handler_datagrams(NetworkHandler *handler, const Datagram &packed)
+{
+  assert(handler != nullptr);
+  if (handler->m_outbound.is_streaming())
+  {
+    // one at a time, so each can keep its place behind the stream
+    vector<Datagram> datagrams;
+    if (!unpack_datagrams(datagrams, packed))
+    {
+      return false;
+    }
+
+    return send_handler_datagrams(handler, datagrams);
+  }
+
+  Datagram framed;
+  uint8_t lane = NETWORK_LANE_BULK;
+  if (!repack_datagrams(framed, &handler->m_codec, packed, m_writer.get_tcp_header_size(), &lane))
+  {
+    return false;
+  }
+
+  if (!framed.get_length())
+  {
+    return true;
+  }
+
+  return submit_handler_datagram(handler, lane, framed);
+}
+
+bool NetworkAcceptor::send_handler_datagrams(NetworkHandler *handler, const vector<Datagram> &datagrams)
+{
+  assert(handler != nullptr);
+  if (handler->m_outbound.is_streaming())
+  {
+    for (const Datagram &datagram : datagrams)
+    {
+      Datagram copy(datagram);
+      if (!send_handler_datagram(handler, copy))
+      {
+        return false;
+      }
+    }
+
+    return true;
+  }
+
+  Datagram packed;
+  uint8_t lane = NETWORK_LANE_BULK;
+  for (const Datagram &datagram : datagrams)
+  {
+    if (!pack_datagram(packed, &handler->m_codec, datagram.get_data(), datagram.get_length(), m_writer.get_tcp_header_size()))
+    {
+      return false;
+    }
+
+    lane = min(lane, get_datagram_lane(datagram.get_data(), datagram.get_length()));
+  }
+
+  if (!packed.get_length())
+  {
+    return true;
+  }
+
+  return submit_handler_datagram(handler, lane, packed);
+}
+
+bool NetworkAcceptor::submit_handler_datagram(NetworkHandler *handler, uint8_t lane, const Datagram &framed,
+                                              const ConflationKey *key)
+{
+  assert(handler != nullptr);
+  if (handler->m_disconnecting)
+  {
+    return false;
+  }
+
+  uint64_t num_conflated = handler->m_outbound.m_num_conflated;
+  if (!handler->m_outbound.send(*m_sink, handler->m_connection, lane, framed, key))
+  {
+    return false;
+  }
+
+  m_num_conflated += handler->m_outbound.m_num_conflated - num_conflated;
+
+  // anything held back gets drained by the writer task
+  if (!handler->m_backlogged && handler->m_outbound.has_pending(NUM_NETWORK_LANES - 1))
+  {
+    handler->m_backlogged = true;
+    m_backlogged_handlers.push_back(handler);
+  }
+
+  return true;
+}
+
+void NetworkAcceptor::submit_handler_fragments(NetworkHandler *handler, const vector<Datagram> &fragments,
+                                               const OrderKey *key)
+{
+  assert(handler != nullptr);
+  if (handler->m_disconnecting)
+  {
+    return;
+  }
+
+  handler->m_outbound.stream(fragments, key);
+  if (!handler->m_backlogged)
+  {
+    handler->m_backlogged = true;
+    m_backlogged_handlers.push_back(handler);
+  }
+}
+
+void NetworkAcceptor::disconnect_handler(NetworkHandler *handler)
+{
+  assert(handler != nullptr);
+  handler->disconnected();
+
+  // remove_handler closes the connection, whether we're here because the
+  // peer went away or because we asked for it with request_disconnect
+  remove_handler(handler);
+}
+
+void NetworkAcceptor::request_disconnect(NetworkHandler *handler)
+{
+  assert(handler != nullptr);
+  if (handler->m_disconnecting)
+  {
+    return;
+  }
+
+  // the handler may well be somewhere up our own call stack, so it's torn
+  // down by the writer task instead of right here
+  handler->m_disconnecting = true;
+  m_pending_disconnects.push_back(handler->m_connection);
+}
+
+NetworkHandler* NetworkAcceptor::init_handler(PT(Connection) rendezvous, NetAddress address, PT(Connection) connection)
+{
+  return new NetworkHandler(this, rendezvous, address, connection);
+}
+
+size_t NetworkAcceptor::get_inbound_lane_size(uint8_t lane)
+{
+  return m_reader.get_lane_size(lane);
+}
+
+size_t NetworkAcceptor::get_inbound_lane_high_water(uint8_t lane)
+{
+  return m_reader.get_lane_high_water(lane);
+}
+
+void NetworkAcceptor::set_ingress_limits(double messages_per_second, double bytes_per_second)
+{
+  m_ingress_message_rate = messages_per_second;
+  m_ingress_byte_rate = bytes_per_second;
+
+  unordered_map<Connection*, NetworkHandler*>::iterator it = m_handlers_map.begin();
+  for (; it != m_handlers_map.end(); ++it)
+  {
+    it->second->set_ingress_limits(messages_per_second, bytes_per_second);
+  }
+}
+
+void NetworkAcceptor::set_ingress_action(uint8_t action)
+{
+  nassertv(action <= INGRESS_ACTION_DISCONNECT);
+  m_ingress_action = action;
+}
+
+uint8_t NetworkAcceptor::get_ingress_action()
+{
+  return m_ingress_action;
+}
+
+void NetworkAcceptor::ingress_datagram(NetworkHandler *handler, NetDatagram &datagram, double now)
+{
+  // control traffic is never held back, and anything behind deferred
+  // traffic has to wait its turn to keep the handler's messages in order
+  if (handler->m_codec.is_negotiated())
+  {
+    stamp_trace_frame(datagram, TRACE_STAGE_READ);
+  }
+
+  bool control = get_datagram_lane(datagram.get_data(), datagram.get_length()) == NETWORK_LANE_CONTROL;
+  if (control || (handler->m_deferred.empty() && handler->consume_ingress(datagram.get_length(), now)))
+  {
+    dispatch_datagram(handler, datagram);
+    return;
+  }
+
+  switch (m_ingress_action)
+  {
+    case INGRESS_ACTION_DEFER:
+      {
+        if (handler->m_deferred.size() >= (size_t)otp_ingress_max_deferred)
+        {
+          handler->m_num_dropped++;
+          return;
+        }
+
+        handler->m_deferred.push_back(datagram);
+        handler->m_deferred_size += datagram.get_length();
+        if (!handler->m_deferring)
+        {
+          handler->m_deferring = true;
+          m_deferring_handlers.push_back(handler);
+        }
+      }
+      break;
+    case INGRESS_ACTION_DROP:
+      {
+        handler->m_num_dropped++;
+      }
+      break;
+    case INGRESS_ACTION_DISCONNECT:
+      {
+        libotp_cat.warning() << "Disconnecting " << handler->m_address.get_ip_string()
+                             << " for exceeding its ingress limits!" << endl;
+
+        disconnect_handler(handler);
+      }
+      break;
+  }
+}
+
+void NetworkAcceptor::dispatch_datagram(NetworkHandler *handler, NetDatagram &datagram)
+{
+  if (handler->m_codec.is_encoded(datagram))
+  {
+    Datagram decoded;
+    if (!handler->m_codec.decode(datagram, decoded))
+    {
+      libotp_cat.warning() << "Dropping a datagram from " << handler->m_address.get_ip_string()
+                           << " that could not be decoded!" << endl;
+      return;
+    }
+
+    if (handler->m_codec.is_incomplete())
+    {
+      return;
+    }
+
+    // whatever this message gets routed to carries its trace on
+    if (handler->m_codec.has_received_trace())
+    {
+      m_current_trace = handler->m_codec.m_received_trace;
+      m_current_trace.stamp(TRACE_STAGE_DISPATCH);
+      m_tracing = true;
+    }
+
+    DatagramIterator iterator(decoded);
+    handler->receive_datagram(iterator);
+    m_tracing = false;
+    return;
+  }
+
+  DatagramIterator iterator(datagram);
+  handler->receive_datagram(iterator);
+}
+
+void NetworkAcceptor::service_deferred(double now)
+{
+  // every deferring handler gets up to a quantum of its backlog serviced
+  // per frame, round robin, so one flooding handler can't starve the rest.
+  // dispatching can disconnect other handlers and take them off the list,
+  // so it may run dry before we've been round once
+  size_t num_handlers = m_deferring_handlers.size();
+  for (size_t i = 0; i < num_handlers && !m_deferring_handlers.empty(); i++)
+  {
+    NetworkHandler *handler = m_deferring_handlers.front();
+    m_deferring_handlers.pop_front();
+
+    PT(Connection) connection = handler->m_connection;
+    for (int count = 0; count < otp_ingress_quantum && !handler->m_deferred.empty(); count++)
+    {
+      NetDatagram &datagram = handler->m_deferred.front();
+      if (!handler->consume_ingress(datagram.get_length(), now))
+      {
+        break;
+      }
+
+      NetDatagram deferred = datagram;
+      handler->m_deferred_size -= datagram.get_length();
+      handler->m_deferred.pop_front();
+      dispatch_datagram(handler, deferred);
+
+      // the handler may have disconnected itself while handling that
+      if (get_handler(connection) != handler)
+      {
+        handler = nullptr;
+        break;
+      }
+    }
 
-  // setup up our polling tasks
-  m_reader_task = new GenericAsyncTask("_reader_task", &NetworkConnector::reader_poll, this);
-  m_disconnect_task = new GenericAsyncTask("_disconnect_task", &NetworkConnector::disconnect_poll, this);
+    if (handler == nullptr)
+    {
+      continue;
+    }
 
-  task_mgr->add(m_reader_task);
-  task_mgr->add(m_disconnect_task);
-}
+    if (handler->m_deferred.empty())
+    {
+      handler->m_deferring = false;
+      continue;
+    }
 
-NetworkConnector::~NetworkConnector()
-{
-  task_mgr->remove(m_reader_task);
-  task_mgr->remove(m_disconnect_task);
+    m_deferring_handlers.push_back(handler);
+  }
 }
 
-void NetworkConnector::setup_connection()
+size_t NetworkAcceptor::get_outbound_lane_size(uint8_t lane)
 {
-  m_connection = m_manager.open_TCP_client_connection(m_address, m_port, m_timeout_ms);
-  if (!m_connection)
+  size_t size = 0;
+  for (NetworkHandler *handler : m_backlogged_handlers)
   {
-    throw runtime_error("Failed to open TCP client connection!");
+    size += handler->m_outbound.get_lane_size(lane);
   }
 
-  m_reader.add_connection(m_connection);
+  return size;
 }
 
-bool NetworkConnector::send_datagram(Datagram &datagram)
+bool NetworkAcceptor::is_reader_lock_free()
 {
-  return m_writer.send(datagram, m_connection);
+  return m_reader.is_lock_free();
 }
 
-void NetworkConnector::receive_datagram(DatagramIterator &iterator)
+uint64_t NetworkAcceptor::get_num_reader_ring_full()
 {
+  return m_reader.get_num_ring_full();
+}
 
+uint64_t NetworkAcceptor::get_num_reader_ring_retries()
+{
+  return m_reader.get_num_ring_retries();
 }
 
-void NetworkConnector::disconnected()
+size_t NetworkAcceptor::get_num_accepted()
 {
+  return m_num_accepted;
+}
 
+size_t NetworkAcceptor::get_accept_high_water()
+{
+  return m_accept_high_water;
 }
 
-void NetworkConnector::disconnect()
+bool NetworkAcceptor::is_io_uring()
 {
-  m_reader.remove_connection(m_connection);
-  disconnected();
+  return m_uring != nullptr;
 }
 
-AsyncTask::DoneStatus NetworkConnector::reader_poll(GenericAsyncTask *task, void *data)
+uint64_t NetworkAcceptor::get_num_io_submits()
 {
-  NetworkConnector *self = (NetworkConnector*)data;
-  if (self->m_reader.data_available())
-  {
-    Datagram datagram;
-    if (self->m_reader.get_data(datagram))
-    {
-      DatagramIterator iterator(datagram);
-      self->receive_datagram(iterator);
-    }
-  }
+  return m_uring != nullptr ? m_uring->m_num_submits : 0;
+}
 
-  return AsyncTask::DS_cont;
+uint64_t NetworkAcceptor::get_num_io_messages()
+{
+  return m_uring != nullptr ? m_uring->m_num_received + m_uring->m_num_sent : 0;
 }
 
-AsyncTask::DoneStatus NetworkConnector::disconnect_poll(GenericAsyncTask *task, void *data)
+void NetworkAcceptor::set_unreliable_message_type(uint16_t message_type, bool unreliable)
 {
-  NetworkConnector *self = (NetworkConnector*)data;
-  if (!self->m_reader.is_connection_ok(self->m_connection))
-  {
-    self->disconnect();
-    return AsyncTask::DS_done;
-  }
+  m_unreliable_types.set(message_type, unreliable);
+}
 
-  return AsyncTask::DS_cont;
+bool NetworkAcceptor::is_unreliable_message_type(uint16_t message_type)
+{
+  return m_unreliable_types.has(message_type);
 }
 
-NetworkHandler::NetworkHandler(NetworkAcceptor *acceptor, PT(Connection) rendezvous, NetAddress address, PT(Connection) connection)
-  : m_acceptor(acceptor), m_rendezvous(rendezvous), m_address(address), m_connection(connection)
+uint16_t NetworkAcceptor::get_udp_port()
 {
+  return m_udp_port;
+}
 
+uint64_t NetworkAcceptor::get_num_udp_sent()
+{
+  return m_num_udp_sent;
 }
 
-NetworkHandler::~NetworkHandler()
+uint64_t NetworkAcceptor::get_num_udp_received()
 {
+  return m_num_udp_received;
+}
 
+uint64_t NetworkAcceptor::get_num_udp_stale()
+{
+  return m_num_udp_stale;
 }
 
-bool NetworkHandler::send_datagram(Datagram &datagram)
+uint64_t NetworkAcceptor::get_num_udp_lost()
 {
-  return m_acceptor->send_handler_datagram(this, datagram);
+  return m_num_udp_lost;
 }
 
-void NetworkHandler::receive_datagram(DatagramIterator &iterator)
+void NetworkAcceptor::set_conflatable_message_type(uint16_t message_type, uint16_t field_offset, uint8_t field_size)
 {
+  nassertv(field_size <= 8);
+  if (m_conflation_rules.empty())
+  {
+    m_conflation_rules.resize(UINT16_MAX + 1);
+  }
 
+  ConflationRule &rule = m_conflation_rules[message_type];
+  rule.m_enabled = true;
+  rule.m_field_offset = field_offset;
+  rule.m_field_size = field_size;
 }
 
-void NetworkHandler::disconnected()
+void NetworkAcceptor::clear_conflatable_message_type(uint16_t message_type)
 {
+  if (m_conflation_rules.empty())
+  {
+    return;
+  }
 
+  m_conflation_rules[message_type] = ConflationRule();
 }
 
-NetworkAcceptor::NetworkAcceptor(const char *address, uint16_t port, uint32_t backlog, size_t num_threads)
-  : m_address(address), m_port(port), m_backlog(backlog), m_listener(&m_manager, num_threads),
-    m_reader(&m_manager, num_threads), m_writer(&m_manager, num_threads)
+bool NetworkAcceptor::is_conflatable_message_type(uint16_t message_type)
 {
-  // setup our connection
-  setup_connection();
-
-  // setup up our polling tasks
-  m_listen_task = new GenericAsyncTask("_listen_task", &NetworkAcceptor::listener_poll, this);
-  m_reader_task = new GenericAsyncTask("_reader_task", &NetworkAcceptor::reader_poll, this);
-  m_disconnect_task = new GenericAsyncTask("_disconnect_task", &NetworkAcceptor::disconnect_poll, this);
+  return !m_conflation_rules.empty() && m_conflation_rules[message_type].m_enabled;
+}
 
-  task_mgr->add(m_listen_task);
-  task_mgr->add(m_reader_task);
-  task_mgr->add(m_disconnect_task);
+uint64_t NetworkAcceptor::get_num_conflated()
+{
+  return m_num_conflated;
 }
 
-NetworkAcceptor::~NetworkAcceptor()
+void NetworkAcceptor::load_conflation_rules()
 {
-  task_mgr->remove(m_listen_task);
-  task_mgr->remove(m_reader_task);
-  task_mgr->remove(m_disconnect_task);
+  // entries are a message type, optionally followed by the offset and size
+  // of its key in the payload, e.g. "2005 2006:0:6" for a doId and field id
+  istringstream stream(otp_conflate_message_types.get_value());
+  string entry;
+  while (stream >> entry)
+  {
+    unsigned int message_type = 0, field_offset = 0, field_size = 0;
+    int num_fields = sscanf(entry.c_str(), "%u:%u:%u", &message_type, &field_offset, &field_size);
+    if (num_fields < 1 || num_fields == 2 || message_type > UINT16_MAX || field_offset > UINT16_MAX || field_size > 8)
+    {
+      libotp_cat.warning() << "Ignoring invalid conflation rule " << entry << "!" << endl;
+      continue;
+    }
+
+    set_conflatable_message_type((uint16_t)message_type, (uint16_t)field_offset, (uint8_t)field_size);
+  }
 }
 
-void NetworkAcceptor::setup_connection()
+bool NetworkAcceptor::get_conflation_key(const Datagram &datagram, ConflationKey &key)
 {
-  m_connection = m_manager.open_TCP_server_rendezvous(m_address, m_port, m_backlog);
-  if (!m_connection)
+  if (m_conflation_rules.empty())
   {
-    throw runtime_error("Failed to open TCP server rendezvous!");
+    return false;
   }
 
-  m_listener.add_connection(m_connection);
+  MessageHeader header;
+  if (!header.parse(datagram.get_data(), datagram.get_length()) || header.m_control)
+  {
+    return false;
+  }
+
+  const ConflationRule &rule = m_conflation_rules[header.m_message_type];
+  if (!rule.m_enabled)
+  {
+    return false;
+  }
+
+  // updates only supersede each other when they come from the same sender,
+  // a recipient channel like a zone hears from any number of objects
+  key.m_channel = header.get_channel(0);
+  key.m_sender = header.m_sender;
+  key.m_message_type = header.m_message_type;
+  key.m_field = 0;
+  if (rule.m_field_size)
+  {
+    // an update too short to hold its key can't be keyed, so it's never
+    // conflated
+    if (header.m_payload_length < (size_t)rule.m_field_offset + rule.m_field_size)
+    {
+      return false;
+    }
+
+    const unsigned char *field = header.m_payload + rule.m_field_offset;
+    for (uint8_t i = 0; i < rule.m_field_size; i++)
+    {
+      key.m_field |= (uint64_t)field[i] << (i * 8);
+    }
+  }
+
+  return true;
 }
 
-bool NetworkAcceptor::has_handler(NetworkHandler *handler)
+void NetworkAcceptor::open_udp_channel()
 {
-  assert(handler != nullptr);
-  unordered_map<Connection*, NetworkHandler*>::iterator it = m_handlers_map.begin();
-  it = m_handlers_map.find(handler->m_connection);
-  return it != m_handlers_map.end();
+  if (!otp_udp_side_channel)
+  {
+    return;
+  }
+
+  m_udp_port = otp_udp_port > 0 ? (uint16_t)otp_udp_port : m_port;
+  m_udp_connection = m_manager.open_UDP_connection(m_address, m_udp_port);
+  if (!m_udp_connection)
+  {
+    throw runtime_error("Failed to open UDP side channel!");
+  }
+
+  m_reader.add_connection(m_udp_connection);
 }
 
-void NetworkAcceptor::add_handler(NetworkHandler *handler)
+uint32_t NetworkAcceptor::open_udp_endpoint(NetworkHandler *handler)
 {
   assert(handler != nullptr);
-  if (has_handler(handler))
+  if (m_udp_connection == nullptr)
   {
-    return;
+    return 0;
   }
 
-  m_handlers_map.insert(pair<Connection*, NetworkHandler*>(handler->m_connection, handler));
-  m_reader.add_connection(handler->m_connection);
+  if (handler->m_udp_token)
+  {
+    return handler->m_udp_token;
+  }
+
+  // the token is all that ties a hello to its handler, so it's random
+  // rather than something another host could guess
+  static mt19937 generator(random_device{}());
+  uint32_t token;
+  do
+  {
+    token = (uint32_t)generator();
+  } while (!token || m_udp_tokens.count(token));
+
+  handler->m_udp_token = token;
+  m_udp_tokens.insert(pair<uint32_t, NetworkHandler*>(token, handler));
+  return token;
 }
 
-void NetworkAcceptor::remove_handler(NetworkHandler *handler)
+bool NetworkAcceptor::send_handler_unreliable(NetworkHandler *handler, Datagram &datagram)
 {
   assert(handler != nullptr);
-  if (!has_handler(handler))
+  if (!handler->m_has_udp_endpoint || handler->m_disconnecting)
   {
-    return;
+    return false;
   }
 
-  m_reader.remove_connection(handler->m_connection);
-  unordered_map<Connection*, NetworkHandler*>::iterator it;
-  it = m_handlers_map.find(handler->m_connection);
-  assert(it != m_handlers_map.end());
-  m_handlers_map.erase(handler->m_connection);
-  delete handler;
+  Datagram frame;
+  if (!pack_unreliable_datagram(frame, handler->m_udp_outbound, datagram.get_data(), datagram.get_length(), m_unreliable_types))
+  {
+    return false;
+  }
+
+  return send_udp_frame(frame, handler->m_udp_address);
 }
 
-NetworkHandler* NetworkAcceptor::get_handler(PT(Connection) connection)
+bool NetworkAcceptor::send_udp_frame(const Datagram &frame, const NetAddress &address)
 {
-  unordered_map<Connection*, NetworkHandler*>::iterator it;
-  it = m_handlers_map.find(connection);
-  if (it != m_handlers_map.end())
+  if (should_drop_unreliable())
   {
-    return it->second;
+    m_num_udp_lost++;
+    return true;
   }
 
-  return nullptr;
+  m_num_udp_sent++;
+  return m_udp_writer.send(frame, m_udp_connection, address);
 }
 
-bool NetworkAcceptor::send_handler_datagram(NetworkHandler *handler, Datagram &datagram)
+void NetworkAcceptor::receive_udp_datagram(NetDatagram &datagram, double now)
 {
-  assert(handler != nullptr);
-  return m_writer.send(datagram, handler->m_connection);
+  const NetAddress &address = datagram.get_address();
+  if (datagram.get_length() == UDP_HELLO_SIZE)
+  {
+    DatagramIterator iterator(datagram);
+    if (iterator.get_uint8() != UDP_FRAME_HELLO)
+    {
+      return;
+    }
+
+    uint32_t token = iterator.get_uint32();
+    unordered_map<uint32_t, NetworkHandler*>::iterator it = m_udp_tokens.find(token);
+    if (it == m_udp_tokens.end())
+    {
+      return;
+    }
+
+    NetworkHandler *handler = it->second;
+    if (handler->m_has_udp_endpoint && !(handler->m_udp_address == address))
+    {
+      m_udp_handlers.erase(handler->m_udp_address);
+    }
+
+    handler->m_udp_address = address;
+    handler->m_has_udp_endpoint = true;
+    m_udp_handlers[address] = handler;
+
+    // echo every hello, the connector keeps sending them until one of
+    // these makes it back
+    Datagram echo;
+    echo.add_uint8(UDP_FRAME_HELLO);
+    echo.add_uint32(token);
+    send_udp_frame(echo, address);
+    return;
+  }
+
+  unordered_map<NetAddress, NetworkHandler*, NetAddressHash>::iterator it = m_udp_handlers.find(address);
+  if (it == m_udp_handlers.end() || it->second->m_disconnecting)
+  {
+    return;
+  }
+
+  NetworkHandler *handler = it->second;
+  size_t offset;
+  bool stale;
+  if (!unpack_unreliable_datagram(datagram, handler->m_udp_inbound, offset, stale))
+  {
+    if (stale)
+    {
+      m_num_udp_stale++;
+    }
+
+    return;
+  }
+
+  // an update held back would be stale by the time it got out, so
+  // unreliable traffic over the ingress limits is always dropped
+  if (!handler->consume_ingress(datagram.get_length() - offset, now))
+  {
+    handler->m_num_dropped++;
+    return;
+  }
+
+  m_num_udp_received++;
+  DatagramIterator iterator(datagram, offset);
+  handler->receive_datagram(iterator);
 }
 
-void NetworkAcceptor::disconnect_handler(NetworkHandler *handler)
+void NetworkAcceptor::accept_connection(int fd, const Socket_Address &address)
 {
+  // the connection takes ownership of the socket and closes it for us
+  PT(Connection) connection = new Connection(&m_manager, new Socket_TCP(fd));
+  NetworkHandler *handler = init_handler(m_connection, NetAddress(address), connection);
   assert(handler != nullptr);
-  handler->disconnected();
-  remove_handler(handler);
-}
 
-NetworkHandler* NetworkAcceptor::init_handler(PT(Connection) rendezvous, NetAddress address, PT(Connection) connection)
-{
-  return new NetworkHandler(this, rendezvous, address, connection);
+  add_handler(handler);
 }
 
 AsyncTask::DoneStatus NetworkAcceptor::listener_poll(GenericAsyncTask *task, void *data)
 {
   NetworkAcceptor *self = (NetworkAcceptor*)data;
-  if (self->m_listener.new_connection_available())
+  size_t num_accepted = 0;
+  if (self->m_uring != nullptr)
+  {
+    return AsyncTask::DS_cont;
+  }
+
+#ifdef __linux__
+  int listen_fd = self->m_connection->get_socket()->GetSocket();
+  while (num_accepted < (size_t)otp_accept_batch_size)
+  {
+    struct sockaddr_storage addr;
+    socklen_t addr_length = sizeof(addr);
+    int fd = accept4(listen_fd, (struct sockaddr*)&addr, &addr_length, SOCK_CLOEXEC);
+    if (fd < 0)
+    {
+      if (errno == EINTR || errno == ECONNABORTED)
+      {
+        continue;
+      }
+
+      if (errno != EAGAIN && errno != EWOULDBLOCK)
+      {
+        libotp_cat.warning() << "Failed to accept a connection, errno " << errno << "!" << endl;
+      }
+
+      break;
+    }
+
+    self->accept_connection(fd, get_socket_address(addr));
+    num_accepted++;
+  }
+#else
+  while (num_accepted < (size_t)otp_accept_batch_size && self->m_listener.new_connection_available())
   {
     PT(Connection) rendezvous;
     NetAddress address;
     PT(Connection) connection;
 
-    if (self->m_listener.get_new_connection(rendezvous, address, connection))
+    if (!self->m_listener.get_new_connection(rendezvous, address, connection))
     {
-      NetworkHandler *handler = self->init_handler(rendezvous, address, connection);
-      assert(handler != nullptr);
-
-      self->add_handler(handler);
+      break;
     }
+
+    NetworkHandler *handler = self->init_handler(rendezvous, address, connection);
+    assert(handler != nullptr);
+
+    self->add_handler(handler);
+    num_accepted++;
   }
+#endif
 
+  self->m_num_accepted += num_accepted;
+  self->m_accept_high_water = max(self->m_accept_high_water, num_accepted);
   return AsyncTask::DS_cont;
 }
 
 AsyncTask::DoneStatus NetworkAcceptor::reader_poll(GenericAsyncTask *task, void *data)
 {
   NetworkAcceptor *self = (NetworkAcceptor*)data;
-  if (self->m_reader.data_available())
+  double now = TrueClock::get_global_ptr()->get_short_time();
+  self->service_deferred(now);
+
+  vector<NetDatagram> &batch = self->m_read_batch;
+  batch.clear();
+  if (self->m_uring != nullptr)
   {
-    NetDatagram datagram;
-    if (self->m_reader.get_data(datagram))
-    {
-      PT(Connection) connection = datagram.get_connection();
-      NetworkHandler *handler = self->get_handler(connection);
-      assert(handler != nullptr);
+    vector<int> &accepted = self->m_accepted;
+    accepted.clear();
+    self->m_uring->poll(batch, accepted);
 
-      if (!datagram.get_length())
+#ifdef __linux__
+    for (int fd : accepted)
+    {
+      struct sockaddr_storage addr;
+      socklen_t addr_length = sizeof(addr);
+      if (getpeername(fd, (struct sockaddr*)&addr, &addr_length) != 0)
       {
-        // don't wait for us to check to see if this connection is still alive,
-        // go ahead and just disconnect the handler
-        self->disconnect_handler(handler);
+        close(fd);
+        continue;
       }
-      else
+
+      self->accept_connection(fd, get_socket_address(addr));
+    }
+#endif
+
+    self->m_num_accepted += accepted.size();
+    self->m_accept_high_water = max(self->m_accept_high_water, accepted.size());
+  }
+  else
+  {
+    self->m_reader.get_datagrams(batch, otp_reader_batch_size);
+  }
+
+  for (NetDatagram &datagram : batch)
+  {
+    // the handler may already be gone if it was disconnected earlier on
+    // in this batch
+    PT(Connection) connection = datagram.get_connection();
+    if (self->m_udp_connection != nullptr && connection == self->m_udp_connection)
+    {
+      self->receive_udp_datagram(datagram, now);
+      continue;
+    }
+
+    NetworkHandler *handler = self->get_handler(connection);
+    if (handler == nullptr)
+    {
+      continue;
+    }
+
+    if (!datagram.get_length())
+    {
+      // don't wait for us to check to see if this connection is still alive,
+      // go ahead and just disconnect the handler
+      self->disconnect_handler(handler);
+      continue;
+    }
+
+    self->ingress_datagram(handler, datagram, now);
+  }
+
+  batch.clear();
+  return AsyncTask::DS_cont;
+}
+
+AsyncTask::DoneStatus NetworkAcceptor::writer_poll(GenericAsyncTask *task, void *data)
+{
+  NetworkAcceptor *self = (NetworkAcceptor*)data;
+  if (!self->m_pending_disconnects.empty())
+  {
+    vector<PT(Connection)> pending_disconnects;
+    pending_disconnects.swap(self->m_pending_disconnects);
+    for (const PT(Connection) &connection : pending_disconnects)
+    {
+      NetworkHandler *handler = self->get_handler(connection);
+      if (handler != nullptr)
       {
-        DatagramIterator iterator(datagram);
-        handler->receive_datagram(iterator);
+        self->disconnect_handler(handler);
       }
     }
   }
 
+  // service the backlogged handlers round robin, a handler that could not
+  // be fully drained goes to the back of the line, either the writer is
+  // backed up or it still has fragments streaming out
+  size_t num_handlers = self->m_backlogged_handlers.size();
+  for (size_t i = 0; i < num_handlers; i++)
+  {
+    NetworkHandler *handler = self->m_backlogged_handlers.front();
+    self->m_backlogged_handlers.pop_front();
+    if (!handler->m_outbound.flush(*self->m_sink, handler->m_connection))
+    {
+      self->m_backlogged_handlers.push_back(handler);
+      continue;
+    }
+
+    handler->m_backlogged = false;
+  }
+
+  // everything sent this frame goes to the kernel in one submission
+  if (self->m_uring != nullptr)
+  {
+    self->m_uring->flush();
+  }
+
   return AsyncTask::DS_cont;
 }
 
 AsyncTask::DoneStatus NetworkAcceptor::disconnect_poll(GenericAsyncTask *task, void *data)
 {
   NetworkAcceptor *self = (NetworkAcceptor*)data;
+
+  // anything the reader saw reset, whether or not the manager knew of it
+  vector<PT(Connection)> &dead = self->m_dead_connections;
+  dead.clear();
+  self->m_manager.take_lost_connections(dead);
+
+  // disconnecting a handler takes it out of the map, and its callbacks may
+  // take others with it, so the connections to go are gathered up first
   unordered_map<Connection*, NetworkHandler*>::iterator it = self->m_handlers_map.begin();
   for (; it != self->m_handlers_map.end(); ++it)
   {
     NetworkHandler *handler = it->second;
-    if (!self->m_reader.is_connection_ok(handler->m_connection))
+    bool connection_ok = self->m_uring != nullptr ? self->m_uring->is_connection_ok(handler->m_connection)
+                                                  : self->m_reader.is_connection_ok(handler->m_connection);
+    if (!connection_ok)
     {
-      self->disconnect_handler(handler);
+      dead.push_back(handler->m_connection);
+    }
+  }
+
+  for (const PT(Connection) &connection : dead)
+  {
+    it = self->m_handlers_map.find(connection);
+    if (it != self->m_handlers_map.end())
+    {
+      self->disconnect_handler(it->second);
     }
   }
 
+  dead.clear();
   return AsyncTask::DS_cont;
 }
@@ -28,7 +28,9 @@
 #include <stdint.h>
 #include <string.h>
 #include <stdexcept>
+#include <atomic>
 #include <vector>
+#include <deque>
 #include <unordered_map>
 
 #include "pandabase.h"
@@ -36,48 +38,428 @@
 #include "genericAsyncTask.h"
 #include "netAddress.h"
 #include "connection.h"
+#include "socket_tcp.h"
+#include "socket_address.h"
+
+#include "lightMutex.h"
+#include "lightMutexHolder.h"
+#include "thread.h"
 
 #include "datagram.h"
 #include "datagramIterator.h"
+#include "netDatagram.h"
 
 #include "queuedConnectionManager.h"
 #include "queuedConnectionListener.h"
-#include "queuedConnectionReader.h"
+#include "connectionReader.h"
 #include "connectionWriter.h"
 
+#include "trueClock.h"
+
+#include "linkcodec.h"
+#include "udpchannel.h"
+#include "responsefuture.h"
+
+// Priority lanes used on both the inbound and outbound paths, lower lanes
+// are always serviced first.
+#define NETWORK_LANE_CONTROL  0
+#define NETWORK_LANE_BULK     1
+#define NUM_NETWORK_LANES     2
+
+// Which I/O backend a connector or acceptor runs on. The default follows
+// otp-io-uring, io_uring falls back to Panda's connection reader and
+// writer when it isn't available.
+#define NETWORK_BACKEND_DEFAULT   0
+#define NETWORK_BACKEND_PANDA     1
+#define NETWORK_BACKEND_IO_URING  2
+
 using namespace std;
 
 class NetworkAcceptor;
+class IoUringBackend;
+
+extern PT(AsyncTaskManager) task_mgr;
+
+// The writers are put in raw mode so that several datagrams can be framed
+// into one contiguous buffer and submitted to the writer in a single call.
+// These helpers produce the same length headers the connection reader
+// expects on the other end.
+// When a link codec is given each message is encoded for the link first.
+bool pack_datagram(Datagram &packed, LinkCodec *codec, const void *data, size_t length, int header_size);
+bool repack_datagrams(Datagram &packed, LinkCodec *codec, const Datagram &source, int header_size, uint8_t *lane=nullptr);
+
+// Splits the same length prefixed messages back out into datagrams of their
+// own, returns false if the source is malformed.
+bool unpack_datagrams(vector<Datagram> &datagrams, const Datagram &source);
+
+// Splits a message larger than otp-fragment-size into framed fragments on
+// links that negotiated fragmentation, returns false and leaves fragments
+// empty when the message should go out whole.
+bool fragment_datagram(vector<Datagram> &fragments, LinkCodec *codec, const void *data, size_t length, int header_size);
+
+// Returns the priority lane a message belongs in, control messages addressed
+// to the message director jump ahead of everything else.
+uint8_t get_datagram_lane(const void *data, size_t length);
+
+// A bounded lock-free queue of datagrams with one sequence number per
+// cell, so reader threads can publish without ever taking a lock. Any
+// number of producers may push, only the routing thread pops.
+class DatagramRing
+{
+public:
+  DatagramRing(size_t capacity);
+  ~DatagramRing();
+
+  bool push(const NetDatagram &datagram);
+  bool pop(NetDatagram &datagram);
+  size_t size();
+
+public:
+  atomic<uint64_t> m_num_full;
+  atomic<uint64_t> m_num_retries;
+
+private:
+  class Cell
+  {
+  public:
+    atomic<size_t> m_sequence;
+    NetDatagram m_datagram;
+  };
+
+  Cell *m_cells = nullptr;
+  size_t m_mask = 0;
+
+  // keep the producer and consumer positions on their own cache lines
+  char m_pad0[64];
+  atomic<size_t> m_enqueue_pos;
+  char m_pad1[64];
+  atomic<size_t> m_dequeue_pos;
+  char m_pad2[64];
+};
+
+class LaneConnectionReader : public ConnectionReader
+{
+public:
+  LaneConnectionReader(ConnectionManager *manager, size_t num_threads, bool lock_free=false);
+  virtual ~LaneConnectionReader();
+
+  bool data_available();
+  bool get_data(NetDatagram &datagram);
+  size_t get_datagrams(vector<NetDatagram> &datagrams, size_t max_datagrams);
+
+  bool is_lock_free();
+  size_t get_lane_size(uint8_t lane);
+  size_t get_lane_high_water(uint8_t lane);
+  uint64_t get_num_ring_full();
+  uint64_t get_num_ring_retries();
+
+protected:
+  virtual void receive_datagram(const NetDatagram &datagram);
+
+private:
+  size_t get_total_size();
+  size_t take_datagrams(vector<NetDatagram> &datagrams, size_t max_datagrams);
+
+private:
+  bool m_lock_free;
+
+  LightMutex m_lock;
+  deque<NetDatagram> m_lanes[NUM_NETWORK_LANES];
+  size_t m_high_water[NUM_NETWORK_LANES] = {};
+
+  DatagramRing *m_rings[NUM_NETWORK_LANES] = {};
+};
+
+// Where framed datagrams go once they leave the outbound lanes, either the
+// connection writer or the io_uring backend.
+class FrameSink
+{
+public:
+  virtual ~FrameSink() {}
+
+  virtual bool send_frame(const Datagram &framed, const PT(Connection) &connection) = 0;
+  virtual size_t get_queue_size(const PT(Connection) &connection) = 0;
+};
+
+class WriterFrameSink : public FrameSink
+{
+public:
+  WriterFrameSink(ConnectionWriter *writer);
+
+  virtual bool send_frame(const Datagram &framed, const PT(Connection) &connection);
+  virtual size_t get_queue_size(const PT(Connection) &connection);
+
+private:
+  ConnectionWriter *m_writer;
+};
+
+// Panda's manager only keeps track of the connections it opened or
+// accepted itself, so a reset on a socket we accepted with accept4 is
+// forgotten as soon as it's reported. We hold on to those instead, for the
+// acceptor to disconnect their handlers.
+class AcceptorConnectionManager : public QueuedConnectionManager
+{
+public:
+  void take_lost_connections(vector<PT(Connection)> &connections);
+
+protected:
+  virtual void connection_reset(const PT(Connection) &connection, bool okflag);
+
+private:
+  LightMutex m_lock;
+  vector<PT(Connection)> m_lost_connections;
+};
+
+// How a conflatable message type is keyed beyond its channel, sender and
+// type, by an optional key of up to 8 bytes read out of the payload at a
+// fixed offset, e.g. an object's doId and field id together. A field size
+// of zero means the type has no such key.
+class ConflationRule
+{
+public:
+  bool m_enabled = false;
+  uint16_t m_field_offset = 0;
+  uint8_t m_field_size = 0;
+};
+
+class ConflationKey
+{
+public:
+  bool operator==(const ConflationKey &other) const
+  {
+    return m_channel == other.m_channel && m_sender == other.m_sender &&
+           m_message_type == other.m_message_type && m_field == other.m_field;
+  }
+
+public:
+  uint64_t m_channel = 0;
+  uint64_t m_sender = 0;
+  uint16_t m_message_type = 0;
+  uint64_t m_field = 0;
+};
+
+class ConflationKeyHash
+{
+public:
+  size_t operator()(const ConflationKey &key) const
+  {
+    uint64_t hash = key.m_channel * 0x9e3779b97f4a7c15ULL;
+    hash = (hash ^ key.m_sender) * 0x9e3779b97f4a7c15ULL;
+    hash = (hash ^ key.m_field) * 0x9e3779b97f4a7c15ULL;
+    return (size_t)(hash ^ (hash >> 32) ^ key.m_message_type);
+  }
+};
+
+// Messages from the same sender to the same channel stay in order, even
+// when one of them is fragmented and the next would otherwise overtake it.
+class OrderKey
+{
+public:
+  bool operator==(const OrderKey &other) const
+  {
+    return m_channel == other.m_channel && m_sender == other.m_sender;
+  }
+
+public:
+  uint64_t m_channel = 0;
+  uint64_t m_sender = 0;
+};
+
+class OrderKeyHash
+{
+public:
+  size_t operator()(const OrderKey &key) const
+  {
+    uint64_t hash = (key.m_channel * 0x9e3779b97f4a7c15ULL ^ key.m_sender) * 0x9e3779b97f4a7c15ULL;
+    return (size_t)(hash ^ (hash >> 32));
+  }
+};
+
+// Returns false for control messages and anything that doesn't parse,
+// which have no order to keep with the stream.
+bool get_order_key(const void *data, size_t length, OrderKey &key);
+
+class StreamFrame
+{
+public:
+  Datagram m_frame;
+  OrderKey m_key;
+
+  // the last frame of a message that was ordered behind the stream
+  bool m_release = false;
+};
+
+class OutboundLanes
+{
+public:
+  bool has_pending(uint8_t lane);
+  bool send(FrameSink &sink, const PT(Connection) &connection, uint8_t lane, const Datagram &datagram,
+            const ConflationKey *key=nullptr);
+  void stream(const vector<Datagram> &fragments, const OrderKey *key=nullptr);
+  void stream_behind(const Datagram &framed, const OrderKey &key);
+  bool is_streaming(const OrderKey &key);
+  bool is_streaming();
+  bool flush(FrameSink &sink, const PT(Connection) &connection);
+
+  size_t get_lane_size(uint8_t lane);
+  size_t get_lane_high_water(uint8_t lane);
+  size_t get_stream_size();
+  size_t get_num_bytes();
+  uint64_t get_num_conflated();
+
+public:
+  deque<Datagram> m_lanes[NUM_NETWORK_LANES];
+  size_t m_high_water[NUM_NETWORK_LANES] = {};
+
+  // where each conflatable update still waiting in a lane sits, as an
+  // absolute position counted from the first datagram the lane ever held
+  unordered_map<ConflationKey, uint64_t, ConflationKeyHash> m_conflation[NUM_NETWORK_LANES];
+  uint64_t m_lane_base[NUM_NETWORK_LANES] = {};
+  uint64_t m_num_conflated = 0;
+
+  // fragments of large messages, below every lane and only a few at a
+  // time per flush so everything else can get in between them. Whatever
+  // follows them from the same sender to the same channel queues up here
+  // too instead of overtaking them, m_streaming counts those per key
+  deque<StreamFrame> m_stream;
+  unordered_map<OrderKey, size_t, OrderKeyHash> m_streaming;
+
+  // bytes held in the lanes and the stream, not counting the writer queue
+  size_t m_num_bytes = 0;
+};
+
+// What happens to a datagram from a handler that is over its ingress limits.
+#define INGRESS_ACTION_DEFER       0
+#define INGRESS_ACTION_DROP        1
+#define INGRESS_ACTION_DISCONNECT  2
+
+class TokenBucket
+{
+public:
+  void set_rate(double rate, double burst);
+  void refill(double now);
+  bool has_tokens(double amount);
+
+public:
+  // a rate of zero means unlimited
+  double m_rate = 0.0;
+  double m_burst = 0.0;
+  double m_tokens = 0.0;
+  double m_last = 0.0;
+};
 
 class NetworkConnector : public TypedObject
 {
 PUBLISHED:
-  NetworkConnector(const char *address, uint16_t port, int timeout_ms=5000, size_t num_threads=0);
+  NetworkConnector(const char *address, uint16_t port, int timeout_ms=5000, size_t num_threads=0,
+                   uint8_t backend=NETWORK_BACKEND_DEFAULT);
   virtual ~NetworkConnector();
 
   virtual void setup_connection();
 
   bool send_datagram(Datagram &datagram);
+  bool send_datagrams(const Datagram &packed);
   virtual void receive_datagram(DatagramIterator &iterator);
   virtual void disconnected();
   void disconnect();
 
+  size_t get_inbound_lane_size(uint8_t lane);
+  size_t get_inbound_lane_high_water(uint8_t lane);
+  size_t get_outbound_lane_size(uint8_t lane);
+  size_t get_outbound_lane_high_water(uint8_t lane);
+  size_t get_outbound_stream_size();
+
+  LinkCodec* get_link_codec();
+  TraceAggregator* get_trace_aggregator();
+
+  bool is_io_uring();
+  uint64_t get_num_io_submits();
+  uint64_t get_num_io_messages();
+
+  void set_unreliable_message_type(uint16_t message_type, bool unreliable=true);
+  bool is_unreliable_message_type(uint16_t message_type);
+  bool is_udp_ready();
+  uint64_t get_num_udp_sent();
+  uint64_t get_num_udp_received();
+  uint64_t get_num_udp_stale();
+  uint64_t get_num_udp_lost();
+  uint64_t get_num_received();
+
+  PT(ResponseFuture) send_request(Datagram &datagram, uint16_t response_type, double timeout=-1.0);
+  size_t get_num_requests_in_flight();
+  uint64_t get_num_requests_completed();
+  uint64_t get_num_requests_timed_out();
+
+  bool send_datagrams(const vector<Datagram> &datagrams);
+
 private:
+  bool handle_link_options(const Datagram &datagram);
+  bool hold_datagram(const void *data, size_t length);
+  bool complete_request(const Datagram &datagram);
+  bool handle_udp_endpoint(const Datagram &datagram);
+  void dispatch_datagram(NetDatagram &datagram);
+  void deliver_datagram(const Datagram &datagram);
+  bool send_udp_frame(const Datagram &frame);
+  void receive_udp_datagram(NetDatagram &datagram);
+
   static AsyncTask::DoneStatus reader_poll(GenericAsyncTask *task, void *data);
+  static AsyncTask::DoneStatus writer_poll(GenericAsyncTask *task, void *data);
   static AsyncTask::DoneStatus disconnect_poll(GenericAsyncTask *task, void *data);
 
 private:
   string m_address;
   uint16_t m_port;
   int m_timeout_ms;
+  uint8_t m_backend;
 
   QueuedConnectionManager m_manager;
-  QueuedConnectionReader m_reader;
+  LaneConnectionReader m_reader;
   ConnectionWriter m_writer;
+  WriterFrameSink m_writer_sink;
+  IoUringBackend *m_uring = nullptr;
+  FrameSink *m_sink = nullptr;
+  vector<NetDatagram> m_read_batch;
+  OutboundLanes m_outbound;
+  LinkCodec m_codec;
+  bool m_awaiting_link_options = false;
+
+  // messages that would read as link frames, and anything sent after them,
+  // wait for the link options reply to know whether to escape them
+  vector<Datagram> m_held_datagrams;
+
+  // one in every otp-trace-sample-rate messages sent is traced, once the
+  // link has agreed to carry traces
+  uint32_t m_trace_countdown = 0;
+  uint32_t m_trace_id = 0;
+  TraceAggregator m_traces;
+
+  // the UDP side channel, asked for over TCP and up once the message
+  // director has echoed our hello
+  ConnectionWriter m_udp_writer;
+  PT(Connection) m_udp_connection;
+  NetAddress m_udp_address;
+  uint32_t m_udp_token = 0;
+  bool m_awaiting_udp_endpoint = false;
+  bool m_udp_ready = false;
+  double m_udp_hello_time = 0.0;
+  UnreliableTypes m_unreliable_types;
+  UnreliableSequencer m_udp_outbound;
+  UnreliableSequencer m_udp_inbound;
+  uint64_t m_num_udp_sent = 0;
+  uint64_t m_num_udp_received = 0;
+  uint64_t m_num_udp_stale = 0;
+  uint64_t m_num_udp_lost = 0;
+  uint64_t m_num_received = 0;
+
+  // requests sent through send_request still waiting on their response
+  RequestTable m_requests;
+  uint64_t m_num_requests_completed = 0;
+  uint64_t m_num_requests_timed_out = 0;
 
   PT(Connection) m_connection;
 
   PT(GenericAsyncTask) m_reader_task;
+  PT(GenericAsyncTask) m_writer_task;
   PT(GenericAsyncTask) m_disconnect_task;
 
 public:
@@ -113,10 +495,30 @@ PUBLISHED:
   NetworkHandler(NetworkAcceptor *acceptor, PT(Connection) rendezvous, NetAddress address, PT(Connection) connection);
   virtual ~NetworkHandler();
 
-  bool send_datagram(Datagram &datagram);
+  virtual bool send_datagram(Datagram &datagram);
+  bool send_datagrams(const Datagram &packed);
+  bool send_unreliable_datagram(Datagram &datagram);
   virtual void receive_datagram(DatagramIterator &iterator);
   virtual void disconnected();
 
+  size_t get_outbound_lane_size(uint8_t lane);
+  size_t get_outbound_lane_high_water(uint8_t lane);
+  size_t get_outbound_stream_size();
+  uint64_t get_num_conflated();
+
+  LinkCodec* get_link_codec();
+  bool has_udp_endpoint();
+
+  void set_ingress_limits(double messages_per_second, double bytes_per_second);
+  size_t get_num_deferred();
+  uint64_t get_num_dropped();
+  size_t get_buffered_size();
+
+  bool send_datagrams(const vector<Datagram> &datagrams);
+
+public:
+  bool consume_ingress(size_t length, double now);
+
 private:
   NetworkAcceptor *m_acceptor = nullptr;
 
@@ -124,6 +526,23 @@ public:
   PT(Connection) m_rendezvous;
   NetAddress m_address;
   PT(Connection) m_connection;
+  OutboundLanes m_outbound;
+  bool m_backlogged = false;
+  LinkCodec m_codec;
+
+  TokenBucket m_message_bucket;
+  TokenBucket m_byte_bucket;
+  deque<NetDatagram> m_deferred;
+  size_t m_deferred_size = 0;
+  bool m_deferring = false;
+  uint64_t m_num_dropped = 0;
+  bool m_disconnecting = false;
+
+  uint32_t m_udp_token = 0;
+  bool m_has_udp_endpoint = false;
+  NetAddress m_udp_address;
+  UnreliableSequencer m_udp_outbound;
+  UnreliableSequencer m_udp_inbound;
 
 public:
   static TypeHandle get_class_type()
@@ -155,7 +574,8 @@ private:
 class NetworkAcceptor : public TypedObject
 {
 PUBLISHED:
-  NetworkAcceptor(const char *address, uint16_t port, uint32_t backlog, size_t num_threads=0);
+  NetworkAcceptor(const char *address, uint16_t port, uint32_t backlog, size_t num_threads=0,
+                  uint8_t backend=NETWORK_BACKEND_DEFAULT);
   virtual ~NetworkAcceptor();
 
   virtual void setup_connection();
@@ -165,30 +585,126 @@ PUBLISHED:
   void remove_handler(NetworkHandler *handler);
   NetworkHandler* get_handler(PT(Connection) connection);
   bool send_handler_datagram(NetworkHandler *handler, Datagram &datagram);
+  bool send_handler_datagrams(NetworkHandler *handler, const Datagram &packed);
   void disconnect_handler(NetworkHandler *handler);
+  void request_disconnect(NetworkHandler *handler);
 
   virtual NetworkHandler* init_handler(PT(Connection) rendezvous, NetAddress address, PT(Connection) connection);
 
+  size_t get_inbound_lane_size(uint8_t lane);
+  size_t get_inbound_lane_high_water(uint8_t lane);
+  size_t get_outbound_lane_size(uint8_t lane);
+
+  void set_ingress_limits(double messages_per_second, double bytes_per_second);
+  void set_ingress_action(uint8_t action);
+  uint8_t get_ingress_action();
+
+  bool is_reader_lock_free();
+  uint64_t get_num_reader_ring_full();
+  uint64_t get_num_reader_ring_retries();
+
+  size_t get_num_accepted();
+  size_t get_accept_high_water();
+
+  bool is_io_uring();
+  uint64_t get_num_io_submits();
+  uint64_t get_num_io_messages();
+
+  void set_unreliable_message_type(uint16_t message_type, bool unreliable=true);
+  bool is_unreliable_message_type(uint16_t message_type);
+  uint16_t get_udp_port();
+  uint64_t get_num_udp_sent();
+  uint64_t get_num_udp_received();
+  uint64_t get_num_udp_stale();
+  uint64_t get_num_udp_lost();
+
+  void set_conflatable_message_type(uint16_t message_type, uint16_t field_offset=0, uint8_t field_size=0);
+  void clear_conflatable_message_type(uint16_t message_type);
+  bool is_conflatable_message_type(uint16_t message_type);
+  uint64_t get_num_conflated();
+
+  bool send_handler_datagrams(NetworkHandler *handler, const vector<Datagram> &datagrams);
+
+public:
+  uint32_t open_udp_endpoint(NetworkHandler *handler);
+  bool send_handler_unreliable(NetworkHandler *handler, Datagram &datagram);
+  bool submit_handler_datagram(NetworkHandler *handler, uint8_t lane, const Datagram &framed,
+                               const ConflationKey *key=nullptr);
+  void submit_handler_fragments(NetworkHandler *handler, const vector<Datagram> &fragments,
+                                const OrderKey *key=nullptr);
+
 private:
+  void accept_connection(int fd, const Socket_Address &address);
+  void ingress_datagram(NetworkHandler *handler, NetDatagram &datagram, double now);
+  void dispatch_datagram(NetworkHandler *handler, NetDatagram &datagram);
+  void service_deferred(double now);
+  void open_udp_channel();
+  void load_conflation_rules();
+  bool get_conflation_key(const Datagram &datagram, ConflationKey &key);
+  bool send_udp_frame(const Datagram &frame, const NetAddress &address);
+  void receive_udp_datagram(NetDatagram &datagram, double now);
+
   static AsyncTask::DoneStatus listener_poll(GenericAsyncTask *task, void *data);
   static AsyncTask::DoneStatus reader_poll(GenericAsyncTask *task, void *data);
+  static AsyncTask::DoneStatus writer_poll(GenericAsyncTask *task, void *data);
   static AsyncTask::DoneStatus disconnect_poll(GenericAsyncTask *task, void *data);
 
 private:
   string m_address;
   uint16_t m_port;
   uint32_t m_backlog;
+  uint8_t m_backend;
 
-  QueuedConnectionManager m_manager;
+  AcceptorConnectionManager m_manager;
   QueuedConnectionListener m_listener;
-  QueuedConnectionReader m_reader;
+  LaneConnectionReader m_reader;
   ConnectionWriter m_writer;
+  WriterFrameSink m_writer_sink;
+  IoUringBackend *m_uring = nullptr;
+  FrameSink *m_sink = nullptr;
+  vector<int> m_accepted;
 
   PT(Connection) m_connection;
   unordered_map<Connection*, NetworkHandler*> m_handlers_map;
+  deque<NetworkHandler*> m_backlogged_handlers;
+  deque<NetworkHandler*> m_deferring_handlers;
+  vector<NetDatagram> m_read_batch;
+  vector<PT(Connection)> m_pending_disconnects;
+  vector<PT(Connection)> m_dead_connections;
+
+  // the UDP side channel, handlers are found by the token they were given
+  // until their hello arrives and by their address after that
+  ConnectionWriter m_udp_writer;
+  PT(Connection) m_udp_connection;
+  uint16_t m_udp_port = 0;
+  unordered_map<uint32_t, NetworkHandler*> m_udp_tokens;
+  unordered_map<NetAddress, NetworkHandler*, NetAddressHash> m_udp_handlers;
+  UnreliableTypes m_unreliable_types;
+  uint64_t m_num_udp_sent = 0;
+  uint64_t m_num_udp_received = 0;
+  uint64_t m_num_udp_stale = 0;
+  uint64_t m_num_udp_lost = 0;
+
+  // indexed directly by message type, sized on the first registration
+  vector<ConflationRule> m_conflation_rules;
+  uint64_t m_num_conflated = 0;
+
+  size_t m_num_accepted = 0;
+  size_t m_accept_high_water = 0;
+
+  double m_ingress_message_rate = 0.0;
+  double m_ingress_byte_rate = 0.0;
+  uint8_t m_ingress_action = INGRESS_ACTION_DEFER;
 
+public:
+  // the trace of the message being handled right now, if it has one
+  TraceRecord m_current_trace;
+  bool m_tracing = false;
+
+private:
   PT(GenericAsyncTask) m_listen_task;
   PT(GenericAsyncTask) m_reader_task;
+  PT(GenericAsyncTask) m_writer_task;
   PT(GenericAsyncTask) m_disconnect_task;
 
 public:
@@ -0,0 +1,368 @@
+// Copyright (c) 2019, Caleb Marshall.
+//
+// This file is part of Toontown OTP.
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+//
+// You should have received a copy of the MIT License
+// along with Toontown OTP. If not, see <https://opensource.org/licenses/MIT>.
+
+#include "profiler.h"
+#include "network.h"
+#include "config_libotp.h"
+#include "trueClock.h"
+
+#include <signal.h>
+#include <algorithm>
+#include <sstream>
+
+// How often the profiler checks for a dump request and decays its counts.
+#define PROFILER_POLL_INTERVAL  1.0
+
+static volatile sig_atomic_t dump_requested = 0;
+
+#ifndef _WIN32
+static void request_dump(int signum)
+{
+  dump_requested = 1;
+}
+#endif
+
+static const char *dimension_names[NUM_PROFILE_DIMENSIONS] = {"channels", "senders", "message types"};
+static const char *metric_names[NUM_PROFILE_METRICS] = {"messages", "bytes"};
+
+static inline uint64_t mix_key(uint64_t key)
+{
+  // splitmix64 finalizer, channels are far from uniformly distributed
+  key ^= key >> 30;
+  key *= 0xbf58476d1ce4e5b9ULL;
+  key ^= key >> 27;
+  key *= 0x94d049bb133111ebULL;
+  key ^= key >> 31;
+  return key;
+}
+
+CountMinSketch::CountMinSketch(size_t width)
+{
+  size_t size = 1;
+  while (size < width)
+  {
+    size <<= 1;
+  }
+
+  m_cells.resize(size * COUNT_MIN_DEPTH);
+  m_mask = size - 1;
+}
+
+void CountMinSketch::add(uint64_t key, uint64_t bytes, uint64_t &messages_estimate, uint64_t &bytes_estimate)
+{
+  // one hash gives every row its own index (Kirsch-Mitzenmacher)
+  uint64_t hash = mix_key(key);
+  uint32_t h1 = (uint32_t)hash;
+  uint32_t h2 = (uint32_t)(hash >> 32) | 1;
+
+  Cell *cells[COUNT_MIN_DEPTH];
+  uint64_t min_messages = UINT64_MAX;
+  uint64_t min_bytes = UINT64_MAX;
+  for (size_t i = 0; i < COUNT_MIN_DEPTH; i++)
+  {
+    cells[i] = &m_cells[i * (m_mask + 1) + ((h1 + i * h2) & m_mask)];
+    min_messages = min(min_messages, cells[i]->m_messages);
+    min_bytes = min(min_bytes, cells[i]->m_bytes);
+  }
+
+  // conservative update, only raise the cells that are below the new
+  // estimate
+  messages_estimate = min_messages + 1;
+  bytes_estimate = min_bytes + bytes;
+  for (size_t i = 0; i < COUNT_MIN_DEPTH; i++)
+  {
+    cells[i]->m_messages = max(cells[i]->m_messages, messages_estimate);
+    cells[i]->m_bytes = max(cells[i]->m_bytes, bytes_estimate);
+  }
+}
+
+void CountMinSketch::decay()
+{
+  for (Cell &cell : m_cells)
+  {
+    cell.m_messages >>= 1;
+    cell.m_bytes >>= 1;
+  }
+}
+
+void CountMinSketch::clear()
+{
+  for (Cell &cell : m_cells)
+  {
+    cell.m_messages = 0;
+    cell.m_bytes = 0;
+  }
+}
+
+HeavyHitters::HeavyHitters(size_t capacity)
+  : m_capacity(max(capacity, (size_t)1))
+{
+  m_entries.reserve(m_capacity);
+  m_index.reserve(m_capacity);
+}
+
+void HeavyHitters::offer(uint64_t key, uint64_t count)
+{
+  // estimates only grow, so a key that doesn't beat the smallest entry
+  // either isn't in the table or wouldn't change it
+  bool full = m_entries.size() >= m_capacity;
+  if (full && count <= m_entries[m_min].second)
+  {
+    return;
+  }
+
+  unordered_map<uint64_t, size_t>::iterator it = m_index.find(key);
+  if (it != m_index.end())
+  {
+    m_entries[it->second].second = count;
+    if (it->second == m_min)
+    {
+      find_min();
+    }
+
+    return;
+  }
+
+  if (!full)
+  {
+    m_index[key] = m_entries.size();
+    m_entries.push_back(pair<uint64_t, uint64_t>(key, count));
+    if (m_entries.size() == 1 || count < m_entries[m_min].second)
+    {
+      m_min = m_entries.size() - 1;
+    }
+
+    return;
+  }
+
+  m_index.erase(m_entries[m_min].first);
+  m_entries[m_min] = pair<uint64_t, uint64_t>(key, count);
+  m_index[key] = m_min;
+  find_min();
+}
+
+void HeavyHitters::decay()
+{
+  for (pair<uint64_t, uint64_t> &entry : m_entries)
+  {
+    entry.second >>= 1;
+  }
+
+  find_min();
+}
+
+void HeavyHitters::clear()
+{
+  m_entries.clear();
+  m_index.clear();
+  m_min = 0;
+}
+
+void HeavyHitters::sort(vector<pair<uint64_t, uint64_t>> &hitters)
+{
+  hitters = m_entries;
+  std::sort(hitters.begin(), hitters.end(), [](const pair<uint64_t, uint64_t> &a, const pair<uint64_t, uint64_t> &b)
+  {
+    return a.second > b.second;
+  });
+}
+
+void HeavyHitters::find_min()
+{
+  m_min = 0;
+  for (size_t i = 1; i < m_entries.size(); i++)
+  {
+    if (m_entries[i].second < m_entries[m_min].second)
+    {
+      m_min = i;
+    }
+  }
+}
+
+RouteProfiler::RouteProfiler()
+{
+  m_enabled = otp_route_profile;
+  for (uint8_t dimension = 0; dimension < NUM_PROFILE_DIMENSIONS; dimension++)
+  {
+    m_sketches[dimension] = new CountMinSketch(otp_route_profile_width);
+    for (uint8_t metric = 0; metric < NUM_PROFILE_METRICS; metric++)
+    {
+      m_hitters[dimension][metric] = new HeavyHitters(otp_route_profile_top);
+    }
+  }
+
+#ifndef _WIN32
+  if (otp_route_profile_signal)
+  {
+    signal(SIGUSR1, &request_dump);
+  }
+#endif
+
+  m_last_decay = TrueClock::get_global_ptr()->get_short_time();
+  m_profiler_task = new GenericAsyncTask("_profiler_task", &RouteProfiler::profiler_poll, this);
+  m_profiler_task->set_delay(PROFILER_POLL_INTERVAL);
+  task_mgr->add(m_profiler_task);
+}
+
+RouteProfiler::~RouteProfiler()
+{
+  task_mgr->remove(m_profiler_task);
+  for (uint8_t dimension = 0; dimension < NUM_PROFILE_DIMENSIONS; dimension++)
+  {
+    delete m_sketches[dimension];
+    for (uint8_t metric = 0; metric < NUM_PROFILE_METRICS; metric++)
+    {
+      delete m_hitters[dimension][metric];
+    }
+  }
+}
+
+void RouteProfiler::set_enabled(bool enabled)
+{
+  m_enabled = enabled;
+}
+
+bool RouteProfiler::is_enabled()
+{
+  return m_enabled;
+}
+
+void RouteProfiler::reset()
+{
+  for (uint8_t dimension = 0; dimension < NUM_PROFILE_DIMENSIONS; dimension++)
+  {
+    m_sketches[dimension]->clear();
+    for (uint8_t metric = 0; metric < NUM_PROFILE_METRICS; metric++)
+    {
+      m_hitters[dimension][metric]->clear();
+      m_sorted[dimension][metric].clear();
+    }
+  }
+
+  m_num_messages = 0;
+  m_num_bytes = 0;
+}
+
+size_t RouteProfiler::get_num_hitters(uint8_t dimension, uint8_t metric)
+{
+  nassertr(dimension < NUM_PROFILE_DIMENSIONS && metric < NUM_PROFILE_METRICS, 0);
+  m_hitters[dimension][metric]->sort(m_sorted[dimension][metric]);
+  return m_sorted[dimension][metric].size();
+}
+
+uint64_t RouteProfiler::get_hitter_key(uint8_t dimension, uint8_t metric, size_t n)
+{
+  nassertr(dimension < NUM_PROFILE_DIMENSIONS && metric < NUM_PROFILE_METRICS, 0);
+  nassertr(n < m_sorted[dimension][metric].size(), 0);
+  return m_sorted[dimension][metric][n].first;
+}
+
+uint64_t RouteProfiler::get_hitter_count(uint8_t dimension, uint8_t metric, size_t n)
+{
+  nassertr(dimension < NUM_PROFILE_DIMENSIONS && metric < NUM_PROFILE_METRICS, 0);
+  nassertr(n < m_sorted[dimension][metric].size(), 0);
+  return m_sorted[dimension][metric][n].second;
+}
+
+uint64_t RouteProfiler::get_num_messages()
+{
+  return m_num_messages;
+}
+
+uint64_t RouteProfiler::get_num_bytes()
+{
+  return m_num_bytes;
+}
+
+void RouteProfiler::write(ostream &out)
+{
+  out << "route profile, " << m_num_messages << " messages, " << m_num_bytes << " bytes\n";
+  for (uint8_t dimension = 0; dimension < NUM_PROFILE_DIMENSIONS; dimension++)
+  {
+    for (uint8_t metric = 0; metric < NUM_PROFILE_METRICS; metric++)
+    {
+      out << "  top " << dimension_names[dimension] << " by " << metric_names[metric] << ":\n";
+
+      size_t num_hitters = get_num_hitters(dimension, metric);
+      for (size_t n = 0; n < num_hitters; n++)
+      {
+        out << "    " << m_sorted[dimension][metric][n].first << " " << m_sorted[dimension][metric][n].second << "\n";
+      }
+    }
+  }
+}
+
+void RouteProfiler::dump()
+{
+  ostringstream out;
+  write(out);
+  libotp_cat.info() << out.str();
+}
+
+void RouteProfiler::record_message(uint64_t channel, uint64_t sender, uint16_t message_type, size_t length)
+{
+  m_num_messages++;
+  m_num_bytes += length;
+
+  uint64_t keys[NUM_PROFILE_DIMENSIONS] = {channel, sender, message_type};
+  for (uint8_t dimension = 0; dimension < NUM_PROFILE_DIMENSIONS; dimension++)
+  {
+    uint64_t messages, bytes;
+    m_sketches[dimension]->add(keys[dimension], length, messages, bytes);
+    m_hitters[dimension][PROFILE_METRIC_MESSAGES]->offer(keys[dimension], messages);
+    m_hitters[dimension][PROFILE_METRIC_BYTES]->offer(keys[dimension], bytes);
+  }
+}
+
+void RouteProfiler::decay()
+{
+  for (uint8_t dimension = 0; dimension < NUM_PROFILE_DIMENSIONS; dimension++)
+  {
+    m_sketches[dimension]->decay();
+    for (uint8_t metric = 0; metric < NUM_PROFILE_METRICS; metric++)
+    {
+      m_hitters[dimension][metric]->decay();
+    }
+  }
+}
+
+AsyncTask::DoneStatus RouteProfiler::profiler_poll(GenericAsyncTask *task, void *data)
+{
+  RouteProfiler *self = (RouteProfiler*)data;
+  if (dump_requested)
+  {
+    dump_requested = 0;
+    self->dump();
+  }
+
+  double now = TrueClock::get_global_ptr()->get_short_time();
+  if (otp_route_profile_decay > 0.0 && now - self->m_last_decay >= otp_route_profile_decay)
+  {
+    self->decay();
+    self->m_last_decay = now;
+  }
+
+  return AsyncTask::DS_again;
+}
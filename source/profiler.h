@@ -0,0 +1,149 @@
+// Copyright (c) 2019, Caleb Marshall.
+//
+// This file is part of Toontown OTP.
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+//
+// You should have received a copy of the MIT License
+// along with Toontown OTP. If not, see <https://opensource.org/licenses/MIT>.
+
+#pragma once
+
+#include <stdint.h>
+#include <string.h>
+#include <vector>
+#include <unordered_map>
+
+#include "pandabase.h"
+#include "genericAsyncTask.h"
+
+using namespace std;
+
+// What a route profiler ranks by, and what it counts.
+#define PROFILE_DIMENSION_CHANNEL  0
+#define PROFILE_DIMENSION_SENDER   1
+#define PROFILE_DIMENSION_TYPE     2
+#define NUM_PROFILE_DIMENSIONS     3
+
+#define PROFILE_METRIC_MESSAGES  0
+#define PROFILE_METRIC_BYTES     1
+#define NUM_PROFILE_METRICS      2
+
+#define COUNT_MIN_DEPTH  4
+
+// A count-min sketch that counts messages and bytes side by side, so one
+// hash of the key serves both. Estimates never undercount, and with
+// conservative updates they rarely overcount by much.
+class CountMinSketch
+{
+public:
+  CountMinSketch(size_t width);
+
+  void add(uint64_t key, uint64_t bytes, uint64_t &messages_estimate, uint64_t &bytes_estimate);
+  void decay();
+  void clear();
+
+private:
+  class Cell
+  {
+  public:
+    uint64_t m_messages = 0;
+    uint64_t m_bytes = 0;
+  };
+
+  vector<Cell> m_cells;
+  size_t m_mask;
+};
+
+// The K keys with the highest estimated counts. A key only gets in by
+// beating the smallest entry, so lookups for everything else stop at the
+// hash map.
+class HeavyHitters
+{
+public:
+  HeavyHitters(size_t capacity);
+
+  void offer(uint64_t key, uint64_t count);
+  void decay();
+  void clear();
+  void sort(vector<pair<uint64_t, uint64_t>> &hitters);
+
+private:
+  void find_min();
+
+private:
+  size_t m_capacity;
+  vector<pair<uint64_t, uint64_t>> m_entries;
+  unordered_map<uint64_t, size_t> m_index;
+  size_t m_min = 0;
+};
+
+// Tracks the heaviest destination channels, senders and message types seen
+// by route_datagram, by message count and by bytes, in bounded memory.
+// Counts are halved every otp-route-profile-decay seconds so the rankings
+// follow the current load, and SIGUSR1 dumps them to the log.
+class RouteProfiler
+{
+PUBLISHED:
+  RouteProfiler();
+  ~RouteProfiler();
+
+  void set_enabled(bool enabled);
+  bool is_enabled();
+  void reset();
+
+  size_t get_num_hitters(uint8_t dimension, uint8_t metric);
+  uint64_t get_hitter_key(uint8_t dimension, uint8_t metric, size_t n);
+  uint64_t get_hitter_count(uint8_t dimension, uint8_t metric, size_t n);
+  uint64_t get_num_messages();
+  uint64_t get_num_bytes();
+
+  void write(ostream &out);
+  void dump();
+
+public:
+  inline void record(uint64_t channel, uint64_t sender, uint16_t message_type, size_t length)
+  {
+    if (m_enabled)
+    {
+      record_message(channel, sender, message_type, length);
+    }
+  }
+
+  void record_message(uint64_t channel, uint64_t sender, uint16_t message_type, size_t length);
+  void decay();
+
+private:
+  static AsyncTask::DoneStatus profiler_poll(GenericAsyncTask *task, void *data);
+
+public:
+  bool m_enabled = false;
+  uint64_t m_num_messages = 0;
+  uint64_t m_num_bytes = 0;
+
+  CountMinSketch *m_sketches[NUM_PROFILE_DIMENSIONS] = {};
+  HeavyHitters *m_hitters[NUM_PROFILE_DIMENSIONS][NUM_PROFILE_METRICS] = {};
+
+  // sorted copies of the hitters handed out to python, rebuilt by each
+  // call to get_num_hitters
+  vector<pair<uint64_t, uint64_t>> m_sorted[NUM_PROFILE_DIMENSIONS][NUM_PROFILE_METRICS];
+
+  double m_last_decay = 0.0;
+  PT(GenericAsyncTask) m_profiler_task;
+};
@@ -0,0 +1,234 @@
+// Copyright (c) 2019, Caleb Marshall.
+//
+// This file is part of Toontown OTP.
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+//
+// You should have received a copy of the MIT License
+// along with Toontown OTP. If not, see <https://opensource.org/licenses/MIT>.
+
+#include "responsefuture.h"
+#include "config_libotp.h"
+
+TypeHandle ResponseDatagram::_type_handle;
+TypeHandle ResponseFuture::_type_handle;
+
+ResponseDatagram::ResponseDatagram(const Datagram &datagram)
+  : m_datagram(datagram)
+{
+
+}
+
+ResponseDatagram::~ResponseDatagram()
+{
+
+}
+
+const Datagram &ResponseDatagram::get_datagram() const
+{
+  return m_datagram;
+}
+
+ResponseFuture::ResponseFuture(uint32_t context, uint16_t response_type)
+  : m_context(context), m_response_type(response_type)
+{
+
+}
+
+ResponseFuture::~ResponseFuture()
+{
+
+}
+
+uint32_t ResponseFuture::get_context() const
+{
+  return m_context;
+}
+
+uint16_t ResponseFuture::get_response_type() const
+{
+  return m_response_type;
+}
+
+const Datagram &ResponseFuture::get_response() const
+{
+  static const Datagram empty;
+  if (m_response == nullptr)
+  {
+    return empty;
+  }
+
+  return m_response->get_datagram();
+}
+
+void ResponseFuture::set_response(const Datagram &response)
+{
+  // the result holds its own reference, it stays valid for as long as
+  // anyone keeps it whether or not the future is still around
+  m_response = new ResponseDatagram(response);
+  set_result(m_response.p());
+}
+
+PT(ResponseFuture) RequestTable::open(uint16_t response_type, double deadline)
+{
+  if (m_slots.empty())
+  {
+    size_t num_slots = (size_t)max(1, min(otp_request_max_in_flight.get_value(), MAX_REQUESTS_IN_FLIGHT));
+    m_slots.resize(num_slots);
+    m_free_slots.reserve(num_slots);
+    for (size_t i = num_slots; i > 0; i--)
+    {
+      m_free_slots.push_back((uint16_t)(i - 1));
+    }
+  }
+
+  if (m_free_slots.empty())
+  {
+    return nullptr;
+  }
+
+  uint16_t index = m_free_slots.back();
+  m_free_slots.pop_back();
+
+  Slot &slot = m_slots[index];
+  uint32_t context = ((uint32_t)slot.m_generation << 16) | index;
+  slot.m_future = new ResponseFuture(context, response_type);
+  m_num_in_flight++;
+
+  // requests that complete well before their deadline leave their heap
+  // entries behind, so at a high enough rate those would pile up
+  if (m_deadlines.size() >= 64 && m_deadlines.size() >= m_num_in_flight * 2)
+  {
+    compact();
+  }
+
+  m_deadlines.push_back(Deadline(deadline, context));
+  push_heap(m_deadlines.begin(), m_deadlines.end(), greater<Deadline>());
+  return slot.m_future;
+}
+
+bool RequestTable::complete(uint32_t context, uint16_t message_type, const Datagram &response)
+{
+  if (!is_open(context))
+  {
+    return false;
+  }
+
+  // only the response type the request asked for counts, anything else
+  // that happens to lead with the same four bytes is left alone
+  PT(ResponseFuture) future = m_slots[context & 0xffff].m_future;
+  if (future->get_response_type() != message_type)
+  {
+    return false;
+  }
+
+  release(context);
+  future->set_response(response);
+  return true;
+}
+
+void RequestTable::cancel(uint32_t context)
+{
+  if (!is_open(context))
+  {
+    return;
+  }
+
+  PT(ResponseFuture) future = m_slots[context & 0xffff].m_future;
+  release(context);
+  future->cancel();
+}
+
+size_t RequestTable::expire(double now)
+{
+  size_t num_expired = 0;
+  while (!m_deadlines.empty() && m_deadlines.front().first <= now)
+  {
+    uint32_t context = m_deadlines.front().second;
+    pop_heap(m_deadlines.begin(), m_deadlines.end(), greater<Deadline>());
+    m_deadlines.pop_back();
+    if (is_open(context))
+    {
+      cancel(context);
+      num_expired++;
+    }
+  }
+
+  return num_expired;
+}
+
+void RequestTable::cancel_all()
+{
+  vector<Deadline> deadlines;
+  deadlines.swap(m_deadlines);
+  for (const Deadline &deadline : deadlines)
+  {
+    cancel(deadline.second);
+  }
+}
+
+size_t RequestTable::size()
+{
+  return m_num_in_flight;
+}
+
+bool RequestTable::is_open(uint32_t context)
+{
+  uint32_t index = context & 0xffff;
+  if (index >= m_slots.size())
+  {
+    return false;
+  }
+
+  const Slot &slot = m_slots[index];
+  return slot.m_future != nullptr && slot.m_generation == (context >> 16);
+}
+
+void RequestTable::release(uint32_t context)
+{
+  uint16_t index = (uint16_t)(context & 0xffff);
+  Slot &slot = m_slots[index];
+  slot.m_future = nullptr;
+
+  // generation zero is skipped so no context id is ever zero
+  if (!++slot.m_generation)
+  {
+    slot.m_generation = 1;
+  }
+
+  m_free_slots.push_back(index);
+  m_num_in_flight--;
+}
+
+void RequestTable::compact()
+{
+  // only the entries of requests still in flight are kept, so the heap
+  // never holds more than twice as many as there are requests
+  vector<Deadline>::iterator last = m_deadlines.begin();
+  for (const Deadline &deadline : m_deadlines)
+  {
+    if (is_open(deadline.second))
+    {
+      *last++ = deadline;
+    }
+  }
+
+  m_deadlines.erase(last, m_deadlines.end());
+  make_heap(m_deadlines.begin(), m_deadlines.end(), greater<Deadline>());
+}
@@ -0,0 +1,170 @@
+// Copyright (c) 2019, Caleb Marshall.
+//
+// This file is part of Toontown OTP.
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+//
+// You should have received a copy of the MIT License
+// along with Toontown OTP. If not, see <https://opensource.org/licenses/MIT>.
+
+#pragma once
+
+#include <stdint.h>
+#include <vector>
+#include <algorithm>
+#include <functional>
+
+#include "pandabase.h"
+#include "asyncFuture.h"
+#include "datagram.h"
+
+using namespace std;
+
+// The most requests a connector may have in flight, context ids only have
+// room for a 16 bit slot index next to the slot's generation.
+#define MAX_REQUESTS_IN_FLIGHT  65536
+
+// The result a ResponseFuture completes with, a reference counted copy of
+// the response so whoever awaited it can keep it as long as they like.
+class ResponseDatagram : public TypedReferenceCount
+{
+PUBLISHED:
+  const Datagram &get_datagram() const;
+
+public:
+  ResponseDatagram(const Datagram &datagram);
+  virtual ~ResponseDatagram();
+
+private:
+  Datagram m_datagram;
+
+public:
+  static TypeHandle get_class_type()
+  {
+    return _type_handle;
+  }
+
+  static void init_type()
+  {
+    TypedReferenceCount::init_type();
+    register_type(_type_handle, "ResponseDatagram", TypedReferenceCount::get_class_type());
+  }
+
+  virtual TypeHandle get_type() const
+  {
+    return get_class_type();
+  }
+
+  virtual TypeHandle force_init_type()
+  {
+    init_type();
+    return get_class_type();
+  }
+
+private:
+  static TypeHandle _type_handle;
+};
+
+// Completes with the response to a request sent through
+// NetworkConnector::send_request, or is cancelled if none arrives in
+// time. The result is a ResponseDatagram holding the whole response
+// message, header included.
+class ResponseFuture : public AsyncFuture
+{
+PUBLISHED:
+  uint32_t get_context() const;
+  uint16_t get_response_type() const;
+  const Datagram &get_response() const;
+
+public:
+  ResponseFuture(uint32_t context, uint16_t response_type);
+  virtual ~ResponseFuture();
+
+  void set_response(const Datagram &response);
+
+private:
+  uint32_t m_context = 0;
+  uint16_t m_response_type = 0;
+  PT(ResponseDatagram) m_response;
+
+public:
+  static TypeHandle get_class_type()
+  {
+    return _type_handle;
+  }
+
+  static void init_type()
+  {
+    AsyncFuture::init_type();
+    register_type(_type_handle, "ResponseFuture", AsyncFuture::get_class_type());
+  }
+
+  virtual TypeHandle get_type() const
+  {
+    return get_class_type();
+  }
+
+  virtual TypeHandle force_init_type()
+  {
+    init_type();
+    return get_class_type();
+  }
+
+private:
+  static TypeHandle _type_handle;
+};
+
+// Requests in flight, in a flat table of slots. A context id is the slot
+// index in its low 16 bits and the slot's generation in its high 16 bits,
+// so a late response to a request that already timed out can never be
+// mistaken for the one that reused its slot. Deadlines are kept in a heap
+// and anything already completed is skipped when it comes up, those are
+// swept out whenever they make up more than half of the heap.
+class RequestTable
+{
+public:
+  PT(ResponseFuture) open(uint16_t response_type, double deadline);
+  bool complete(uint32_t context, uint16_t message_type, const Datagram &response);
+  void cancel(uint32_t context);
+  size_t expire(double now);
+  void cancel_all();
+
+  size_t size();
+
+private:
+  bool is_open(uint32_t context);
+  void release(uint32_t context);
+  void compact();
+
+private:
+  class Slot
+  {
+  public:
+    PT(ResponseFuture) m_future;
+    uint16_t m_generation = 1;
+  };
+
+  vector<Slot> m_slots;
+  vector<uint16_t> m_free_slots;
+  size_t m_num_in_flight = 0;
+
+  // a min heap on the deadline, kept with push_heap and pop_heap
+  typedef pair<double, uint32_t> Deadline;
+  vector<Deadline> m_deadlines;
+};
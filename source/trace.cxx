@@ -0,0 +1,213 @@
+// Copyright (c) 2019, Caleb Marshall.
+//
+// This file is part of Toontown OTP.
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+//
+// You should have received a copy of the MIT License
+// along with Toontown OTP. If not, see <https://opensource.org/licenses/MIT>.
+
+#include "trace.h"
+#include "msgtypes.h"
+#include "messageheader.h"
+
+#include <algorithm>
+#include <chrono>
+
+static const char *stage_names[NUM_TRACE_STAGES + 1] = {"send", "read", "dispatch", "route", "receive", "total"};
+
+uint64_t get_trace_time()
+{
+  return chrono::duration_cast<chrono::microseconds>(chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+void TraceRecord::stamp(uint8_t stage)
+{
+  nassertv(stage < NUM_TRACE_STAGES);
+  m_stamps[stage] = get_trace_time();
+}
+
+void TraceRecord::write(Datagram &datagram) const
+{
+  datagram.add_uint32(m_id);
+  for (uint8_t stage = 0; stage < NUM_TRACE_STAGES; stage++)
+  {
+    datagram.add_uint64(m_stamps[stage]);
+  }
+}
+
+void TraceRecord::read(const unsigned char *trailer)
+{
+  m_id = load_uint32(trailer);
+  trailer += sizeof(uint32_t);
+  for (uint8_t stage = 0; stage < NUM_TRACE_STAGES; stage++)
+  {
+    m_stamps[stage] = load_uint64(trailer);
+    trailer += sizeof(uint64_t);
+  }
+}
+
+bool stamp_trace_frame(Datagram &frame, uint8_t stage)
+{
+  nassertr(stage < NUM_TRACE_STAGES, false);
+  size_t length = frame.get_length();
+  const unsigned char *bytes = (const unsigned char*)frame.get_data();
+  if (length < 1 + TRACE_TRAILER_SIZE || bytes[0] != LINK_FRAME_TRACE)
+  {
+    return false;
+  }
+
+  // only sampled frames come through here, so a copy is fine
+  string stamped((const char*)bytes, length);
+  uint64_t now = get_trace_time();
+  size_t offset = length - TRACE_TRAILER_SIZE + sizeof(uint32_t) + stage * sizeof(uint64_t);
+  for (size_t i = 0; i < sizeof(uint64_t); i++)
+  {
+    stamped[offset + i] = (char)((now >> (i * 8)) & 0xff);
+  }
+
+  frame.clear();
+  frame.append_data(stamped.data(), stamped.size());
+  return true;
+}
+
+TraceAggregator::TraceAggregator()
+{
+
+}
+
+TraceAggregator::~TraceAggregator()
+{
+
+}
+
+void TraceAggregator::reset()
+{
+  m_num_traces = 0;
+  memset(m_num_samples, 0, sizeof(m_num_samples));
+  memset(m_total, 0, sizeof(m_total));
+  memset(m_max, 0, sizeof(m_max));
+  memset(m_buckets, 0, sizeof(m_buckets));
+}
+
+uint64_t TraceAggregator::get_num_traces()
+{
+  return m_num_traces;
+}
+
+uint64_t TraceAggregator::get_num_samples(uint8_t stage)
+{
+  nassertr(stage <= TRACE_STAGE_TOTAL, 0);
+  return m_num_samples[stage];
+}
+
+double TraceAggregator::get_mean_latency(uint8_t stage)
+{
+  nassertr(stage <= TRACE_STAGE_TOTAL, 0.0);
+  if (!m_num_samples[stage])
+  {
+    return 0.0;
+  }
+
+  return (double)m_total[stage] / (double)m_num_samples[stage] / 1000000.0;
+}
+
+double TraceAggregator::get_max_latency(uint8_t stage)
+{
+  nassertr(stage <= TRACE_STAGE_TOTAL, 0.0);
+  return (double)m_max[stage] / 1000000.0;
+}
+
+double TraceAggregator::get_percentile_latency(uint8_t stage, double percentile)
+{
+  nassertr(stage <= TRACE_STAGE_TOTAL, 0.0);
+  if (!m_num_samples[stage])
+  {
+    return 0.0;
+  }
+
+  // the upper bound of the bucket the percentile falls in
+  uint64_t target = (uint64_t)(percentile * (double)m_num_samples[stage]);
+  uint64_t count = 0;
+  for (int bucket = 0; bucket < TRACE_NUM_BUCKETS; bucket++)
+  {
+    count += m_buckets[stage][bucket];
+    if (count > target || bucket == TRACE_NUM_BUCKETS - 1)
+    {
+      return (double)min((uint64_t)1 << bucket, m_max[stage]) / 1000000.0;
+    }
+  }
+
+  return 0.0;
+}
+
+void TraceAggregator::write(ostream &out)
+{
+  out << "traces: " << m_num_traces << "\n";
+  for (uint8_t stage = TRACE_STAGE_READ; stage <= TRACE_STAGE_TOTAL; stage++)
+  {
+    out << "  " << stage_names[stage] << ": " << m_num_samples[stage] << " samples"
+        << ", mean " << get_mean_latency(stage) * 1000.0 << "ms"
+        << ", p50 " << get_percentile_latency(stage, 0.5) * 1000.0 << "ms"
+        << ", p99 " << get_percentile_latency(stage, 0.99) * 1000.0 << "ms"
+        << ", max " << get_max_latency(stage) * 1000.0 << "ms\n";
+  }
+}
+
+void TraceAggregator::add(const TraceRecord &trace)
+{
+  m_num_traces++;
+
+  // each hop runs from the last stage that was stamped, stages can be
+  // missing when a hop along the way doesn't trace
+  int last = -1;
+  for (uint8_t stage = 0; stage < NUM_TRACE_STAGES; stage++)
+  {
+    if (!trace.m_stamps[stage])
+    {
+      continue;
+    }
+
+    if (last >= 0 && trace.m_stamps[stage] >= trace.m_stamps[last])
+    {
+      add_sample(stage, trace.m_stamps[stage] - trace.m_stamps[last]);
+    }
+
+    last = stage;
+  }
+
+  if (trace.m_stamps[TRACE_STAGE_SEND] && last > TRACE_STAGE_SEND && trace.m_stamps[last] >= trace.m_stamps[TRACE_STAGE_SEND])
+  {
+    add_sample(TRACE_STAGE_TOTAL, trace.m_stamps[last] - trace.m_stamps[TRACE_STAGE_SEND]);
+  }
+}
+
+void TraceAggregator::add_sample(uint8_t stage, uint64_t latency)
+{
+  int bucket = 0;
+  while (bucket < TRACE_NUM_BUCKETS - 1 && ((uint64_t)1 << bucket) < latency)
+  {
+    bucket++;
+  }
+
+  m_num_samples[stage]++;
+  m_total[stage] += latency;
+  m_max[stage] = max(m_max[stage], latency);
+  m_buckets[stage][bucket]++;
+}
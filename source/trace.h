@@ -0,0 +1,104 @@
+// Copyright (c) 2019, Caleb Marshall.
+//
+// This file is part of Toontown OTP.
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+//
+// You should have received a copy of the MIT License
+// along with Toontown OTP. If not, see <https://opensource.org/licenses/MIT>.
+
+#pragma once
+
+#include <stdint.h>
+#include <string.h>
+
+#include "pandabase.h"
+#include "datagram.h"
+
+using namespace std;
+
+// The hops a traced message is stamped at, in the order it passes them.
+#define TRACE_STAGE_SEND      0  // handed to the sending connector
+#define TRACE_STAGE_READ      1  // read off the wire by the message director
+#define TRACE_STAGE_DISPATCH  2  // through ingress limiting, being handled
+#define TRACE_STAGE_ROUTE     3  // routed to a recipient's outbound lanes
+#define TRACE_STAGE_RECEIVE   4  // read off the wire by the recipient
+#define NUM_TRACE_STAGES      5
+
+// Pseudo stage the aggregator keeps end to end latencies under.
+#define TRACE_STAGE_TOTAL  NUM_TRACE_STAGES
+
+#define TRACE_TRAILER_SIZE  (sizeof(uint32_t) + NUM_TRACE_STAGES * sizeof(uint64_t))
+#define TRACE_NUM_BUCKETS   32
+
+// Microseconds on the system wide monotonic clock, so stamps taken by
+// different processes on the same host can be compared. Stamps from
+// different hosts are only as good as their clock sync.
+uint64_t get_trace_time();
+
+// The stamps a sampled message picks up on its way through, carried in a
+// trailer on LINK_FRAME_TRACE frames. A stage that was never stamped is 0.
+class TraceRecord
+{
+public:
+  void stamp(uint8_t stage);
+  void write(Datagram &datagram) const;
+  void read(const unsigned char *trailer);
+
+public:
+  uint32_t m_id = 0;
+  uint64_t m_stamps[NUM_TRACE_STAGES] = {};
+};
+
+// Stamps a stage straight into the trailer of an encoded trace frame,
+// returns false if the frame isn't one.
+bool stamp_trace_frame(Datagram &frame, uint8_t stage);
+
+// Collects finished traces into a latency breakdown per hop, each hop
+// being the time from the previous stamped stage to the one it's named
+// after. Latencies are in seconds, percentiles come from log2 buckets.
+class TraceAggregator
+{
+PUBLISHED:
+  TraceAggregator();
+  ~TraceAggregator();
+
+  void reset();
+
+  uint64_t get_num_traces();
+  uint64_t get_num_samples(uint8_t stage);
+  double get_mean_latency(uint8_t stage);
+  double get_max_latency(uint8_t stage);
+  double get_percentile_latency(uint8_t stage, double percentile);
+
+  void write(ostream &out);
+
+public:
+  void add(const TraceRecord &trace);
+
+private:
+  void add_sample(uint8_t stage, uint64_t latency);
+
+private:
+  uint64_t m_num_traces = 0;
+  uint64_t m_num_samples[NUM_TRACE_STAGES + 1] = {};
+  uint64_t m_total[NUM_TRACE_STAGES + 1] = {};
+  uint64_t m_max[NUM_TRACE_STAGES + 1] = {};
+  uint64_t m_buckets[NUM_TRACE_STAGES + 1][TRACE_NUM_BUCKETS] = {};
+};
@@ -0,0 +1,179 @@
+// Copyright (c) 2019, Caleb Marshall.
+//
+// This file is part of Toontown OTP.
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+//
+// You should have received a copy of the MIT License
+// along with Toontown OTP. If not, see <https://opensource.org/licenses/MIT>.
+
+#include "udpchannel.h"
+#include "messageheader.h"
+#include "config_libotp.h"
+
+#include <random>
+#include <sstream>
+
+UnreliableTypes::UnreliableTypes()
+{
+  istringstream stream(otp_unreliable_message_types.get_value());
+  unsigned int message_type;
+  while (stream >> message_type)
+  {
+    if (message_type <= UINT16_MAX)
+    {
+      set((uint16_t)message_type, true);
+    }
+  }
+}
+
+void UnreliableTypes::set(uint16_t message_type, bool unreliable)
+{
+  if (m_types.empty())
+  {
+    if (!unreliable)
+    {
+      return;
+    }
+
+    m_types.resize(UINT16_MAX + 1);
+  }
+
+  if (m_types[message_type] != unreliable)
+  {
+    m_types[message_type] = unreliable;
+    m_num_types += unreliable ? 1 : -1;
+  }
+}
+
+bool UnreliableTypes::has(uint16_t message_type) const
+{
+  return m_num_types > 0 && m_types[message_type];
+}
+
+uint32_t UnreliableSequencer::next()
+{
+  return ++m_next_sequence;
+}
+
+bool UnreliableSequencer::accept(uint64_t channel, uint64_t sender, uint16_t message_type, uint32_t sequence)
+{
+  Key key = {channel, sender, message_type};
+  unordered_map<Key, Entry, KeyHash>::iterator it = m_sequences.find(key);
+  if (it == m_sequences.end())
+  {
+    // forgetting a key only means one stale update for it could get
+    // through later on, which is no worse than it being lost
+    if (otp_udp_max_sequences > 0 && m_sequences.size() >= (size_t)otp_udp_max_sequences)
+    {
+      m_sequences.erase(m_order.back());
+      m_order.pop_back();
+    }
+
+    m_order.push_front(key);
+    Entry &entry = m_sequences[key];
+    entry.m_sequence = sequence;
+    entry.m_position = m_order.begin();
+    return true;
+  }
+
+  // compare with wraparound, the sequence only has to be ahead of the last
+  Entry &entry = it->second;
+  if ((int32_t)(sequence - entry.m_sequence) <= 0)
+  {
+    return false;
+  }
+
+  entry.m_sequence = sequence;
+  m_order.splice(m_order.begin(), m_order, entry.m_position);
+  return true;
+}
+
+void UnreliableSequencer::clear()
+{
+  // the outbound counter carries on, a peer that still remembers our old
+  // numbers would otherwise take the new ones for stale
+  m_sequences.clear();
+  m_order.clear();
+}
+
+size_t UnreliableSequencer::get_size() const
+{
+  // each entry is a node of its own, plus the bucket array pointing at them
+  return m_sequences.size() * (sizeof(pair<const Key, Entry>) + sizeof(void*) * 2) +
+         m_order.size() * (sizeof(Key) + sizeof(void*) * 2) +
+         m_sequences.bucket_count() * sizeof(void*);
+}
+
+bool pack_unreliable_datagram(Datagram &frame, UnreliableSequencer &sequencer, const void *data, size_t length, const UnreliableTypes &types)
+{
+  if (length + UDP_MESSAGE_HEADER_SIZE > (size_t)otp_udp_max_size)
+  {
+    return false;
+  }
+
+  MessageHeader header;
+  if (!header.parse((const unsigned char*)data, length) || header.m_control || !types.has(header.m_message_type))
+  {
+    return false;
+  }
+
+  frame.add_uint8(UDP_FRAME_MESSAGE);
+  frame.add_uint32(sequencer.next());
+  frame.append_data(data, length);
+  return true;
+}
+
+bool unpack_unreliable_datagram(const Datagram &frame, UnreliableSequencer &sequencer, size_t &offset, bool &stale)
+{
+  stale = false;
+  const unsigned char *data = (const unsigned char*)frame.get_data();
+  size_t length = frame.get_length();
+  if (length < UDP_MESSAGE_HEADER_SIZE || data[0] != UDP_FRAME_MESSAGE)
+  {
+    return false;
+  }
+
+  MessageHeader header;
+  if (!header.parse(data + UDP_MESSAGE_HEADER_SIZE, length - UDP_MESSAGE_HEADER_SIZE) || header.m_control)
+  {
+    return false;
+  }
+
+  if (!sequencer.accept(header.get_channel(0), header.m_sender, header.m_message_type, load_uint32(data + 1)))
+  {
+    stale = true;
+    return false;
+  }
+
+  offset = UDP_MESSAGE_HEADER_SIZE;
+  return true;
+}
+
+bool should_drop_unreliable()
+{
+  double loss_rate = otp_udp_loss_rate;
+  if (loss_rate <= 0.0)
+  {
+    return false;
+  }
+
+  static mt19937 generator(random_device{}());
+  return uniform_real_distribution<double>(0.0, 1.0)(generator) < loss_rate;
+}
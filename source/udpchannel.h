@@ -0,0 +1,141 @@
+// Copyright (c) 2019, Caleb Marshall.
+//
+// This file is part of Toontown OTP.
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+//
+// You should have received a copy of the MIT License
+// along with Toontown OTP. If not, see <https://opensource.org/licenses/MIT>.
+
+#pragma once
+
+#include <stdint.h>
+#include <string.h>
+#include <vector>
+#include <list>
+#include <unordered_map>
+
+#include "pandabase.h"
+#include "datagram.h"
+#include "netAddress.h"
+
+using namespace std;
+
+// Frames on the UDP side channel. A hello carries the uint32 token the
+// message director handed out over TCP and is echoed back once the
+// endpoint is known, a message carries the uint32 sequence number for its
+// channel and message type followed by the message itself.
+#define UDP_FRAME_HELLO    0
+#define UDP_FRAME_MESSAGE  1
+
+#define UDP_HELLO_SIZE           5
+#define UDP_MESSAGE_HEADER_SIZE  5
+
+// The set of message types sent over the side channel when one is up,
+// starts out as whatever otp-unreliable-message-types lists.
+class UnreliableTypes
+{
+public:
+  UnreliableTypes();
+
+  void set(uint16_t message_type, bool unreliable);
+  bool has(uint16_t message_type) const;
+
+private:
+  vector<bool> m_types;
+  size_t m_num_types = 0;
+};
+
+// Latest value wins per channel, sender and message type. On the way out
+// every update takes the next number of a single counter for the whole
+// link, so there's nothing to remember per key and the numbers of any one
+// key still only ever go up. On the way in anything that isn't newer than
+// what we've already seen for its key was superseded and is dropped. The
+// inbound side only remembers the otp-udp-max-sequences keys it heard from
+// most recently, a peer can't make it grow without bound by sending to
+// ever more channels.
+class UnreliableSequencer
+{
+public:
+  uint32_t next();
+  bool accept(uint64_t channel, uint64_t sender, uint16_t message_type, uint32_t sequence);
+  void clear();
+
+  size_t get_size() const;
+
+private:
+  class Key
+  {
+  public:
+    bool operator==(const Key &other) const
+    {
+      return m_channel == other.m_channel && m_sender == other.m_sender && m_message_type == other.m_message_type;
+    }
+
+  public:
+    uint64_t m_channel;
+    uint64_t m_sender;
+    uint16_t m_message_type;
+  };
+
+  class KeyHash
+  {
+  public:
+    size_t operator()(const Key &key) const
+    {
+      uint64_t hash = (key.m_channel * 0x9e3779b97f4a7c15ULL ^ key.m_sender) * 0x9e3779b97f4a7c15ULL;
+      return (size_t)(hash ^ (hash >> 32) ^ key.m_message_type);
+    }
+  };
+
+  class Entry
+  {
+  public:
+    uint32_t m_sequence = 0;
+    list<Key>::iterator m_position;
+  };
+
+  uint32_t m_next_sequence = 0;
+  unordered_map<Key, Entry, KeyHash> m_sequences;
+
+  // inbound keys, most recently heard from first
+  list<Key> m_order;
+};
+
+class NetAddressHash
+{
+public:
+  size_t operator()(const NetAddress &address) const
+  {
+    return address.get_hash();
+  }
+};
+
+// Frames a message for the side channel, returns false if it can't go
+// unreliably, because it's a control message, it's malformed or it's
+// larger than otp-udp-max-size.
+bool pack_unreliable_datagram(Datagram &frame, UnreliableSequencer &sequencer, const void *data, size_t length, const UnreliableTypes &types);
+
+// Checks a message frame off against the sequencer, returns false if it's
+// malformed or stale. On success offset is where the message starts.
+bool unpack_unreliable_datagram(const Datagram &frame, UnreliableSequencer &sequencer, size_t &offset, bool &stale);
+
+// Loss injection for testing, true for the otp-udp-loss-rate fraction of
+// outgoing frames that should be dropped on the floor.
+bool should_drop_unreliable();